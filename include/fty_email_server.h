@@ -36,6 +36,34 @@ extern "C" {
 //      verbose             1 turns verbose mode on, 0 off
 //      assets              path to state file for assets
 //      alerts              path to state file for alerts
+//      language            default language of alert notifications, contacts may
+//                          state their own as $contact;$language
+//      languages           comma separated languages of contacts, loaded with the
+//                          configuration; other languages fall back to the default
+//      render_cache_size   number of rendered alert notifications to cache per worker [256],
+//                          0 disables the cache
+//      workers             number of workers sending emails in parallel [1], messages
+//                          for one recipient are always handled by the same worker
+//      queue_size          number of requests waiting for each worker [1024], requests
+//                          over the limit are refused with BUSY reply
+//      memory_budget       bytes of queued and in-render requests of all actors in the
+//                          process [67108864], 0 means no limit
+//      mail_policy         what to do with SENDMAIL over the budget [reject]
+//                          reject  reply BUSY
+//                          spill   store it in spool_dir, send it when budget is available
+//                          block   stop reading from broker until budget is available
+//      alert_policy        what to do with SENDMAIL_ALERT/SENDSMS_ALERT over the budget [spill]
+//      spool_dir           directory of spilled requests [/var/lib/fty/fty-email/spool],
+//                          SENDMAIL_ASYNC requests are stored in its async subdirectory
+//      stats_file          file, where metrics are written in Prometheus text format [""]
+//      stats_interval      seconds between writes of stats_file [60]
+//      trace_threshold     requests slower than this (ms) are logged with times of stages [10000]
+//      deliveries_file     file, where records of the last deliveries are written on SIGUSR1
+//                          [/var/lib/fty/fty-email/deliveries.txt]
+//      events_batch        delivery events published in one message on malamute/producer [64]
+//      events_interval     ms the oldest delivery event waits for the batch [1000]
+//      capture_dir         directory, where mailbox requests are recorded to <name>.cap
+//                          for fty-email-bench --replay, empty disables capture [""]
 //  smtp
 //      server              address of smtp server
 //      port                port number
@@ -50,6 +78,8 @@ extern "C" {
 //      verbose             1 setup verbose mode of mlm_client, 0 turn it off
 //      endpoint            malamute endpoint address
 //      address             mailbox address of agent-smtp
+//      producer            stream, where status of SENDMAIL_ASYNC requests and
+//                          DELIVERY-EVENTS are published, see DeliveryEvents
 //      consumers
 //          ALERTS  .*      consume all messages on ALERTS stream
 //          ASSETS  .*      consume all messages on ASSETS stream
@@ -60,6 +90,13 @@ extern "C" {
 //  LOAD    path            load and apply configuration from zpl file
 //                          see Configuration format section
 //
+//  RENDERCACHE             reply with [hits|misses|size|description hits|description misses]
+//                          of rendered alerts cache and translated descriptions cache,
+//                          summed over all workers
+//
+//  BUDGET                  reply with [used|limit|peak|spooled] bytes of memory budget
+//                          and number of requests in spool
+//
 //  Malamute protocol (mailbox agent-smtp)
 //  ======================================
 //
@@ -78,6 +115,80 @@ extern "C" {
 //  REP: subject=SENDMAIL-ERR [$uuid|$error code|$error message]
 //      if email wasn't sent, or there was improper number of arguments
 //      error message comes from msmtp stderr and is NOT normalized!
+//  REP: subject=SENDMAIL-BUSY [$uuid|11|$reason|$retry after ms]
+//      if queue of the worker is full, request should be sent again later
+//
+//  REQ: subject=SENDMAIL_ASYNC
+//
+//      the same as SENDMAIL
+//  REP: subject=SENDMAIL-ACCEPTED [$uuid|0|ACCEPTED]
+//      email was stored to the spool, final status [$uuid|$code|$message] (as in
+//      SENDMAIL-OK/ERR) is published on malamute/producer stream with subject $uuid,
+//      then email is removed from the spool; emails left there by a stopped agent
+//      are sent again (and their status published again) when it starts
+//  REP: subject=SENDMAIL-BUSY [$uuid|11|$reason|$retry after ms]
+//      if email can't be stored, request should be sent again later
+//      without malamute/producer the request is processed and answered as SENDMAIL
+//
+//  REQ: subject=SENDMAIL_BATCH
+//
+//      [$uuid|$email1|$email2|...]
+//      sends all emails, each $email is a SENDMAIL request [$uuid|$to|...] or
+//      [$uuid|$data] serialized by zmsg_encode, see fty_email_batch_append
+//      emails of the batch are sent by one worker one after another, with
+//      the same settings and msmtp configuration
+//  REP: subject=SENDMAIL_BATCH [$uuid|$failed|$uuid1|$code1|$message1|$uuid2|...]
+//      $failed is the number of emails not sent, followed by the status of each
+//      email in the order of the request, $code and $message as in SENDMAIL-OK/ERR
+//  REP: subject=SENDMAIL_BATCH [$uuid|BUSY|$retry after ms]
+//      if queue of the worker is full, request should be sent again later
+//
+//  REQ: subject=SENDMAIL_EACH
+//
+//      [$uuid|$to1,$to2,...|$subject|$body|$headers:zhash_t|attachment1|...]
+//      sends personal copy of email to each recipient of comma separated list,
+//      each copy has only its own To: header; MIME body and attachments are
+//      rendered only once and shared by all copies
+//  REP: subject=SENDMAIL_EACH [$uuid|$failed|$to1|$code1|$message1|$to2|...]
+//      $failed is the number of recipients not reached, followed by the status
+//      of each recipient in order of the list, $code and $message as in SENDMAIL-OK/ERR
+//  REP: subject=SENDMAIL_EACH [$uuid|ERROR|$reason] if there is no recipient
+//  REP: subject=SENDMAIL_EACH [$uuid|BUSY|$retry after ms]
+//      if queue of the worker is full, request should be sent again later
+//
+//  REQ: subject=SENDMAIL_ALERT|SENDSMS_ALERT
+//
+//      [$uuid|$priority|$extname|$contact|alert...]
+//      $contact may be followed by ;$language to override the default language
+//  REP: subject=SENDMAIL_ALERT|SENDSMS_ALERT [$uuid|OK] or [$uuid|ERROR|$reason]
+//  REP: subject=SENDMAIL_ALERT|SENDSMS_ALERT [$uuid|BUSY|$retry after ms]
+//      if queue of the worker is full, request should be sent again later
+//
+//  REQ: subject=NOTIFY_ALERT
+//
+//      [$uuid|$priority|$extname|$emails|$phones|alert...]
+//      $emails and $phones are comma separated lists of contacts, each one may
+//      be followed by ;$language, notification is rendered once per language
+//      and sent to each e-mail, and to phones by SMS gateway; SMS of one language
+//      are one email with many blind recipients, so they share the outcome
+//  REP: subject=NOTIFY_ALERT [$uuid|$failed|$contact1|$code1|$message1|$contact2|...]
+//      $failed is the number of contacts not notified, followed by the status
+//      of each contact, e-mails first; $code and $message as in SENDMAIL-OK/ERR
+//  REP: subject=NOTIFY_ALERT [$uuid|ERROR|$reason] if request is malformed
+//  REP: subject=NOTIFY_ALERT [$uuid|BUSY|$retry after ms]
+//      if queue of the worker is full, request should be sent again later
+//
+//  REQ: subject=STATS [$uuid]
+//  REP: subject=STATS [$uuid|$json]
+//      counters, gauges and histograms of the agent, see Metrics::to_json
+//
+//  REQ: subject=TRACES [$uuid]
+//  REP: subject=TRACES [$uuid|$json]
+//      stages of the last requests in Chrome trace-event format, see Tracer::to_chrome_json
+//
+//  REQ: subject=DELIVERIES [$uuid]
+//  REP: subject=DELIVERIES [$uuid|$records]
+//      records of the last deliveries, one line each, see FlightRecorder::to_string
 //
 //  args:
 //      "sendmail-only"      : ignore consumer/ part, connect as $(malamute/address)-sendmail-only
@@ -105,6 +216,13 @@ FTY_EMAIL_EXPORT zmsg_t *
         const char *body,
         ...);
 
+// append email encoded by fty_email_encode to SENDMAIL_BATCH request
+//  batch - request, its first frame is uuid of the batch
+//  email_p - email, it is destroyed
+//  returns 0 on success, -1 on error
+FTY_EMAIL_EXPORT int
+    fty_email_batch_append (zmsg_t *batch, zmsg_t **email_p);
+
 //  @end
 
 #ifdef __cplusplus
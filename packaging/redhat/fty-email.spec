@@ -64,6 +64,7 @@ BuildRequires:  fty-common-devel
 BuildRequires:  fty-common-mlm-devel
 BuildRequires:  fty-common-translation-devel
 BuildRequires:  fty-proto-devel
+BuildRequires:  systemtap-sdt-devel
 BuildRoot:      %{_tmppath}/%{name}-%{version}-build
 
 %description
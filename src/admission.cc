@@ -0,0 +1,480 @@
+/*  =========================================================================
+    admission - Memory budget, admission policies and spool for queued mail
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    admission - Memory budget, admission policies and spool for queued mail
+@discuss
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// bookkeeping of zmsg_t and one zframe_t, so many tiny frames are not free
+static const size_t FRAME_OVERHEAD = 64;
+
+MemoryBudget::MemoryBudget (size_t limit):
+    _limit {limit},
+    _used {0},
+    _peak {0}
+{
+}
+
+bool
+MemoryBudget::try_acquire (size_t bytes)
+{
+    size_t limit = _limit.load (std::memory_order_relaxed);
+    size_t used = _used.load (std::memory_order_relaxed);
+    do {
+        if (limit != 0 && used != 0 && used + bytes > limit)
+            return false;
+    } while (!_used.compare_exchange_weak (used, used + bytes, std::memory_order_relaxed));
+
+    size_t peak = _peak.load (std::memory_order_relaxed);
+    while (used + bytes > peak && !_peak.compare_exchange_weak (peak, used + bytes, std::memory_order_relaxed))
+        ;
+    return true;
+}
+
+void
+MemoryBudget::release (size_t bytes)
+{
+    size_t used = _used.fetch_sub (bytes, std::memory_order_relaxed);
+    assert (used >= bytes);
+}
+
+BudgetPolicy
+budget_policy_from_string (const char *policy, BudgetPolicy dfl)
+{
+    if (!policy)
+        return dfl;
+    if (strcasecmp (policy, "reject") == 0)
+        return BudgetPolicy::REJECT;
+    if (strcasecmp (policy, "spill") == 0)
+        return BudgetPolicy::SPILL;
+    if (strcasecmp (policy, "block") == 0)
+        return BudgetPolicy::BLOCK;
+    return dfl;
+}
+
+const char*
+budget_policy_to_string (BudgetPolicy policy)
+{
+    switch (policy) {
+        case BudgetPolicy::REJECT:
+            return "reject";
+        case BudgetPolicy::SPILL:
+            return "spill";
+        case BudgetPolicy::BLOCK:
+            return "block";
+    }
+    return "reject";
+}
+
+size_t
+admission_attachment_charge (size_t size)
+{
+    // raw content and its base64 copy, 76 characters + CRLF per line
+    size_t encoded = 4 * ((size + 2) / 3);
+    return size + encoded + 2 * ((encoded + 75) / 76);
+}
+
+// charge of attachments of email [uuid|to|subject|body|headers|path1|path2|...],
+// current frame of msg is the one before uuid
+static size_t
+s_attachments_charge (zmsg_t *msg)
+{
+    size_t ret = 0;
+    zframe_t *frame = NULL;
+    for (size_t i = 0; i != 6; i++)
+        frame = zmsg_next (msg);
+    for (; frame != NULL; frame = zmsg_next (msg)) {
+        std::string path ((const char*) zframe_data (frame), zframe_size (frame));
+        struct stat st;
+        if (stat (path.c_str (), &st) == 0)
+            ret += admission_attachment_charge (st.st_size);
+    }
+    return ret;
+}
+
+size_t
+admission_charge (zmsg_t *msg)
+{
+    size_t ret = FRAME_OVERHEAD;
+    for (zframe_t *frame = zmsg_first (msg); frame != NULL; frame = zmsg_next (msg))
+        ret += zframe_size (frame) + FRAME_OVERHEAD;
+
+    // [sender|$subject|uuid|...]
+    zmsg_first (msg);
+    zframe_t *subject = zmsg_next (msg);
+    if (!subject)
+        return ret;
+
+    // [sender|SENDMAIL|uuid|to|subject|body|headers|path1|path2|...], SENDMAIL_EACH
+    // renders attachments once for all recipients
+    if (zframe_streq (subject, "SENDMAIL") || zframe_streq (subject, "SENDMAIL_ASYNC")
+            || zframe_streq (subject, "SENDMAIL_EACH"))
+        return ret + s_attachments_charge (msg);
+
+    // [sender|SENDMAIL_BATCH|uuid|item1|item2|...], each item is encoded email
+    // items are rendered one by one in the same arena, so the biggest one counts
+    if (zframe_streq (subject, "SENDMAIL_BATCH")) {
+        size_t biggest = 0;
+        zmsg_next (msg);
+        for (zframe_t *frame = zmsg_next (msg); frame != NULL; frame = zmsg_next (msg)) {
+            zmsg_t *item = zmsg_decode (zframe_data (frame), zframe_size (frame));
+            if (!item)
+                continue;
+            // item has no sender/subject, so the walk starts one frame earlier
+            zmsg_pushstr (item, "");
+            zmsg_first (item);
+            biggest = std::max (biggest, s_attachments_charge (item));
+            zmsg_destroy (&item);
+        }
+        ret += biggest;
+    }
+    return ret;
+}
+
+MailSpool::MailSpool ():
+    _dir {},
+    _files {},
+    _held {},
+    _sequence {0}
+{
+}
+
+int
+MailSpool::open (const std::string& dir)
+{
+    _dir.clear ();
+    _files.clear ();
+    _held.clear ();
+    _sequence = 0;
+    if (zsys_dir_create ("%s", dir.c_str ()) == -1) {
+        log_error ("can't create spool directory %s", dir.c_str ());
+        return -1;
+    }
+
+    DIR *d = opendir (dir.c_str ());
+    if (!d) {
+        log_error ("can't open spool directory %s: %s", dir.c_str (), strerror (errno));
+        return -1;
+    }
+    // names are zero padded sequence numbers, so sorting them keeps the order
+    struct dirent *entry;
+    while ((entry = readdir (d)) != NULL) {
+        uint64_t sequence;
+        char suffix [8];
+        if (sscanf (entry->d_name, "%20" SCNu64 ".%7s", &sequence, suffix) == 2 && streq (suffix, "zmsg")) {
+            _files.push_back (entry->d_name);
+            _sequence = std::max (_sequence, sequence + 1);
+        }
+    }
+    closedir (d);
+    _dir = dir;
+    std::sort (_files.begin (), _files.end ());
+    if (!_files.empty ())
+        log_info ("spool %s contains %zu mails from previous run", dir.c_str (), _files.size ());
+    return 0;
+}
+
+bool
+MailSpool::push (zmsg_t **msg_p)
+{
+    assert (msg_p && *msg_p);
+    if (_dir.empty ())
+        return false;
+
+    char name [32];
+    snprintf (name, sizeof (name), "%020" PRIu64 ".zmsg", _sequence);
+    std::string path = _dir + "/" + name;
+    // file appears under its name only when it is complete
+    std::string tmp = path + ".tmp";
+
+    FILE *file = fopen (tmp.c_str (), "w");
+    if (!file) {
+        log_error ("can't spill mail to %s: %s", tmp.c_str (), strerror (errno));
+        return false;
+    }
+    // content must be on the disk before the name, caller may promise delivery
+    int r = zmsg_save (*msg_p, file);
+    if (r != -1)
+        r = fflush (file) == 0 && fsync (fileno (file)) == 0 ? 0 : -1;
+    if (fclose (file) != 0 || r == -1 || rename (tmp.c_str (), path.c_str ()) == -1) {
+        log_error ("can't spill mail to %s: %s", path.c_str (), strerror (errno));
+        unlink (tmp.c_str ());
+        return false;
+    }
+    // rename is durable only when the directory is synced
+    int dir = ::open (_dir.c_str (), O_RDONLY | O_DIRECTORY);
+    if (dir == -1 || fsync (dir) == -1) {
+        log_error ("can't sync spool directory %s: %s", _dir.c_str (), strerror (errno));
+        if (dir != -1)
+            close (dir);
+        unlink (path.c_str ());
+        return false;
+    }
+    close (dir);
+
+    _sequence ++;
+    _files.push_back (name);
+    zmsg_destroy (msg_p);
+    return true;
+}
+
+zmsg_t*
+MailSpool::front ()
+{
+    while (!_files.empty ()) {
+        std::string path = _dir + "/" + _files.front ();
+        FILE *file = fopen (path.c_str (), "r");
+        zmsg_t *msg = NULL;
+        if (file) {
+            msg = zmsg_load (file);
+            fclose (file);
+        }
+        if (msg)
+            return msg;
+        log_error ("can't load spilled mail %s, dropping it", path.c_str ());
+        pop ();
+    }
+    return NULL;
+}
+
+void
+MailSpool::pop ()
+{
+    if (_files.empty ())
+        return;
+    std::string path = _dir + "/" + _files.front ();
+    if (unlink (path.c_str ()) == -1)
+        log_error ("can't remove spilled mail %s: %s", path.c_str (), strerror (errno));
+    _files.pop_front ();
+}
+
+void
+MailSpool::hold (const std::string& key)
+{
+    if (_files.empty ())
+        return;
+    _held.emplace (key, _files.front ());
+    _files.pop_front ();
+}
+
+void
+MailSpool::release (const std::string& key)
+{
+    auto it = _held.find (key);
+    if (it == _held.end ())
+        return;
+    std::string path = _dir + "/" + it->second;
+    if (unlink (path.c_str ()) == -1)
+        log_error ("can't remove spilled mail %s: %s", path.c_str (), strerror (errno));
+    _held.erase (it);
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+admission_test (bool verbose)
+{
+    printf (" * admission: ");
+
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    //  @selftest
+    {
+        MemoryBudget budget {100};
+        assert (budget.try_acquire (60));
+        assert (!budget.try_acquire (50));
+        assert (budget.try_acquire (40));
+        assert (budget.used () == 100);
+        budget.release (60);
+        budget.release (40);
+        assert (budget.used () == 0);
+        assert (budget.peak () == 100);
+
+        // mail bigger than the budget passes alone
+        assert (budget.try_acquire (1000));
+        assert (!budget.try_acquire (1));
+        budget.release (1000);
+
+        // no limit
+        budget.limit (0);
+        assert (budget.try_acquire (1000));
+        assert (budget.try_acquire (1000));
+        budget.release (2000);
+    }
+
+    {
+        assert (budget_policy_from_string ("Spill", BudgetPolicy::REJECT) == BudgetPolicy::SPILL);
+        assert (budget_policy_from_string ("block", BudgetPolicy::REJECT) == BudgetPolicy::BLOCK);
+        assert (budget_policy_from_string ("reject", BudgetPolicy::BLOCK) == BudgetPolicy::REJECT);
+        assert (budget_policy_from_string ("foo", BudgetPolicy::SPILL) == BudgetPolicy::SPILL);
+        assert (budget_policy_from_string (NULL, BudgetPolicy::BLOCK) == BudgetPolicy::BLOCK);
+        assert (streq (budget_policy_to_string (BudgetPolicy::SPILL), "spill"));
+    }
+
+    // attachments are charged by file size and its encoded copy
+    {
+        std::string attachment = std::string (SELFTEST_DIR_RW) + "/admission-attachment";
+        FILE *file = fopen (attachment.c_str (), "w");
+        assert (file);
+        std::string data (10000, 'x');
+        fwrite (data.data (), 1, data.size (), file);
+        fclose (file);
+
+        // raw content and 13336 base64 characters in 176 lines
+        size_t rendered = admission_attachment_charge (10000);
+        assert (rendered == 10000 + 13336 + 2 * 176);
+        assert (admission_attachment_charge (0) == 0);
+        assert (admission_attachment_charge (1) == 1 + 4 + 2);
+
+        for (const char *subject : {"SENDMAIL", "SENDMAIL_ASYNC", "SENDMAIL_EACH"}) {
+            zmsg_t *msg = fty_email_encode ("uuid", "to", "subject", NULL, "body", NULL);
+            zmsg_pushstr (msg, subject);
+            zmsg_pushstr (msg, "sender");
+            size_t plain = admission_charge (msg);
+            assert (plain > zmsg_content_size (msg));
+            zmsg_addstr (msg, attachment.c_str ());
+            zmsg_addstr (msg, attachment.c_str ());
+            assert (admission_charge (msg) == plain + 2 * (attachment.size () + FRAME_OVERHEAD + rendered));
+            zmsg_destroy (&msg);
+        }
+
+        // items of the batch are charged by their own layout
+        {
+            zmsg_t *batch = zmsg_new ();
+            zmsg_addstr (batch, "sender");
+            zmsg_addstr (batch, "SENDMAIL_BATCH");
+            zmsg_addstr (batch, "uuid");
+            size_t plain = admission_charge (batch);
+            for (int i = 0; i != 2; i++) {
+                zmsg_t *item = fty_email_encode ("uuid", "to", "subject", NULL, "body", NULL);
+                zmsg_addstr (item, attachment.c_str ());
+                byte *buffer = NULL;
+                size_t size = zmsg_encode (item, &buffer);
+                zmsg_addmem (batch, buffer, size);
+                free (buffer);
+                zmsg_destroy (&item);
+            }
+            size_t charge = admission_charge (batch);
+            assert (charge >= plain + rendered);
+            assert (charge < plain + 2 * rendered);
+            zmsg_destroy (&batch);
+        }
+
+        // other subjects have no attachments
+        {
+            zmsg_t *msg = fty_email_encode ("uuid", "to", "subject", NULL, "body", NULL);
+            zmsg_pushstr (msg, "SENDMAIL_ALERT");
+            zmsg_pushstr (msg, "sender");
+            zmsg_addstr (msg, attachment.c_str ());
+            assert (admission_charge (msg) == zmsg_content_size (msg) + FRAME_OVERHEAD * (zmsg_size (msg) + 1));
+            zmsg_destroy (&msg);
+        }
+        unlink (attachment.c_str ());
+    }
+
+    // spool keeps the order and survives reopen
+    {
+        std::string dir = std::string (SELFTEST_DIR_RW) + "/spool";
+        {
+            MailSpool spool;
+            assert (spool.open (dir) == 0);
+            while (!spool.empty ())
+                spool.pop ();
+            for (int i = 0; i != 3; i++) {
+                zmsg_t *msg = zmsg_new ();
+                zmsg_addstrf (msg, "%d", i);
+                assert (spool.push (&msg));
+                assert (!msg);
+            }
+            assert (spool.size () == 3);
+
+            zmsg_t *msg = spool.front ();
+            char *s = zmsg_popstr (msg);
+            assert (streq (s, "0"));
+            zstr_free (&s);
+            zmsg_destroy (&msg);
+            spool.pop ();
+        }
+
+        MailSpool spool;
+        assert (spool.open (dir) == 0);
+        assert (spool.size () == 2);
+        for (int i = 1; i != 3; i++) {
+            zmsg_t *msg = spool.front ();
+            char *s = zmsg_popstr (msg);
+            assert (atoi (s) == i);
+            zstr_free (&s);
+            zmsg_destroy (&msg);
+            spool.pop ();
+        }
+        assert (spool.empty ());
+        assert (!spool.front ());
+
+        zmsg_t *msg = zmsg_new ();
+        assert (spool.push (&msg));
+        assert (spool.size () == 1);
+        spool.pop ();
+
+        // held mails are queued again after reopen, until they are released
+        {
+            MailSpool held;
+            assert (held.open (dir) == 0);
+            for (int i = 0; i != 2; i++) {
+                msg = zmsg_new ();
+                zmsg_addstrf (msg, "%d", i);
+                assert (held.push (&msg));
+            }
+            held.hold ("UUID0");
+            held.hold ("UUID1");
+            assert (held.empty ());
+            assert (held.held () == 2);
+            held.release ("UUID0");
+            held.release ("UNKNOWN");
+            assert (held.held () == 1);
+        }
+        assert (spool.open (dir) == 0);
+        assert (spool.size () == 1);
+        msg = spool.front ();
+        char *s = zmsg_popstr (msg);
+        assert (streq (s, "1"));
+        zstr_free (&s);
+        zmsg_destroy (&msg);
+        spool.pop ();
+        zsys_dir_delete ("%s", dir.c_str ());
+    }
+    //  @end
+
+    printf ("OK\n");
+}
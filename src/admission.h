@@ -0,0 +1,166 @@
+/*  =========================================================================
+    admission - Memory budget, admission policies and spool for queued mail
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef ADMISSION_H_INCLUDED
+#define ADMISSION_H_INCLUDED
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <cstdint>
+
+/**
+ * \class MemoryBudget
+ *
+ * \brief Byte budget of queued and in-render mails shared by dispatcher and workers
+ *
+ * Dispatcher acquires the charge of each mail before it is queued, worker
+ * releases it when the reply is sent. Budget can be acquired from any
+ * thread without lock.
+ */
+class MemoryBudget
+{
+    public:
+        static const size_t DEFAULT_LIMIT = 64 * 1024 * 1024;
+
+        explicit MemoryBudget (size_t limit = DEFAULT_LIMIT);
+
+        MemoryBudget (const MemoryBudget&) = delete;
+        MemoryBudget& operator= (const MemoryBudget&) = delete;
+
+        /**
+         * \brief acquire bytes, return false if they don't fit into the limit
+         *
+         * Mail bigger than the whole budget is admitted when nothing else is
+         * charged, so it is not refused forever. Limit 0 means no limit.
+         */
+        bool try_acquire (size_t bytes);
+
+        /** \brief return bytes acquired by try_acquire */
+        void release (size_t bytes);
+
+        void limit (size_t limit) { _limit.store (limit, std::memory_order_relaxed); }
+        size_t limit () const { return _limit.load (std::memory_order_relaxed); }
+        /** \brief bytes acquired now */
+        size_t used () const { return _used.load (std::memory_order_relaxed); }
+        /** \brief highest used () seen */
+        size_t peak () const { return _peak.load (std::memory_order_relaxed); }
+
+    protected:
+        std::atomic <size_t> _limit;
+        std::atomic <size_t> _used;
+        std::atomic <size_t> _peak;
+};
+
+/**
+ * \brief what to do with a mail which doesn't fit into the memory budget
+ */
+enum class BudgetPolicy {
+    // reply BUSY to the sender
+    REJECT,
+    // store the mail in the spool, it is queued when the budget is available
+    SPILL,
+    // stop receiving from the broker until the budget is available
+    BLOCK
+};
+
+/** \brief parse reject|spill|block, return dfl for other values */
+BudgetPolicy
+    budget_policy_from_string (const char *policy, BudgetPolicy dfl);
+
+const char*
+    budget_policy_to_string (BudgetPolicy policy);
+
+/**
+ * \brief memory charged for the queued mail [sender|subject|uuid|...]
+ *
+ * Charge is the size of all frames and, for each attachment of SENDMAIL,
+ * SENDMAIL_ASYNC and SENDMAIL_EACH, the size of the file plus its base64
+ * copy, both held by the renderer. Items of SENDMAIL_BATCH are rendered one
+ * by one, so only attachments of the biggest item are charged.
+ */
+size_t
+    admission_charge (zmsg_t *msg);
+
+/** \brief memory needed to render attachment of size bytes, see admission_charge */
+size_t
+    admission_attachment_charge (size_t size);
+
+/**
+ * \class MailSpool
+ *
+ * \brief FIFO of mails spilled to disk
+ *
+ * Each mail is one file in the spool directory, named by a sequence
+ * number. Files left by the previous run are picked up by open (), so
+ * spilled mails survive restart of the agent. A mail may be held after it
+ * leaves the queue: its file stays until release (), so a mail, which was
+ * not finished before restart, is queued again.
+ */
+class MailSpool
+{
+    public:
+        MailSpool ();
+
+        MailSpool (const MailSpool&) = delete;
+        MailSpool& operator= (const MailSpool&) = delete;
+
+        /** \brief create (if needed) and scan spool directory, return -1 on error */
+        int open (const std::string& dir);
+
+        /**
+         * \brief store the mail, on success *msg_p is destroyed; return false on error or if not open
+         *
+         * File and directory are synced, so the mail survives crash once push returns true.
+         */
+        bool push (zmsg_t **msg_p);
+
+        /** \brief load the oldest mail, NULL if spool is empty; it stays in the spool until pop () */
+        zmsg_t* front ();
+
+        /** \brief remove the oldest mail */
+        void pop ();
+
+        /** \brief remove the oldest mail from the queue, its file is kept until release (key) */
+        void hold (const std::string& key);
+
+        /** \brief remove the file of a mail held under key, if any */
+        void release (const std::string& key);
+
+        size_t held () const { return _held.size (); }
+        size_t size () const { return _files.size (); }
+        bool empty () const { return _files.empty (); }
+        const std::string& dir () const { return _dir; }
+
+    protected:
+        std::string _dir;
+        std::deque <std::string> _files;
+        // key -> file of the held mail
+        std::multimap <std::string, std::string> _held;
+        uint64_t _sequence;
+};
+
+void
+admission_test (bool verbose);
+
+#endif // ADMISSION_H_INCLUDED
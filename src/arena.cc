@@ -0,0 +1,170 @@
+/*  =========================================================================
+    arena - Per-request monotonic memory arena
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    arena - Per-request monotonic memory arena
+@discuss
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <cstdint>
+
+Arena::Arena (size_t chunk_size):
+    _chunk_size {chunk_size},
+    _blocks {},
+    _first {NULL},
+    _ptr {NULL},
+    _end {NULL},
+    _allocations {0},
+    _bytes {0},
+    _chunks {0}
+{
+}
+
+Arena::~Arena ()
+{
+    for (char *block : _blocks)
+        free (block);
+}
+
+char*
+Arena::chunk (size_t size)
+{
+    char *block = static_cast <char*> (malloc (size));
+    if (!block)
+        throw std::bad_alloc ();
+    _blocks.push_back (block);
+    _chunks ++;
+    return block;
+}
+
+void*
+Arena::allocate (size_t size, size_t alignment)
+{
+    _allocations ++;
+    _bytes += size;
+    if (size == 0)
+        size = 1;
+
+    // big request gets dedicated chunk, so the rest of current chunk is not wasted
+    if (size > _chunk_size / 4)
+        return chunk (size);
+
+    uintptr_t aligned = (reinterpret_cast <uintptr_t> (_ptr) + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    if (_ptr == NULL || aligned + size > reinterpret_cast <uintptr_t> (_end)) {
+        _ptr = chunk (_chunk_size);
+        _end = _ptr + _chunk_size;
+        if (!_first)
+            _first = _ptr;
+        aligned = (reinterpret_cast <uintptr_t> (_ptr) + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    }
+    _ptr = reinterpret_cast <char*> (aligned + size);
+    return reinterpret_cast <void*> (aligned);
+}
+
+char*
+Arena::copy (const char *data, size_t size)
+{
+    char *ret = static_cast <char*> (allocate (size + 1, 1));
+    if (size > 0)
+        memcpy (ret, data, size);
+    ret [size] = '\0';
+    return ret;
+}
+
+void
+Arena::reset ()
+{
+    // keep the first regular chunk, return everything else to the system
+    for (char *block : _blocks) {
+        if (block != _first)
+            free (block);
+    }
+    _blocks.clear ();
+    _ptr = _end = NULL;
+    if (_first) {
+        _blocks.push_back (_first);
+        _ptr = _first;
+        _end = _first + _chunk_size;
+    }
+    _allocations = 0;
+    _bytes = 0;
+    _chunks = 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+arena_test (bool verbose)
+{
+    printf (" * arena: ");
+
+    //  @selftest
+    Arena arena {1024};
+    assert (arena.chunks () == 0);
+
+    char *a = arena.copy ("hello", 5);
+    assert (streq (a, "hello"));
+    assert (arena.chunks () == 1);
+
+    void *p = arena.allocate (sizeof (double), alignof (double));
+    assert (reinterpret_cast <uintptr_t> (p) % alignof (double) == 0);
+    assert (arena.allocations () == 2);
+
+    // big allocation gets dedicated chunk, current one is still used
+    char *big = static_cast <char*> (arena.allocate (4096));
+    memset (big, 'x', 4096);
+    assert (arena.chunks () == 2);
+    char *b = arena.copy ("world", 5);
+    assert (streq (b, "world"));
+    assert (arena.chunks () == 2);
+    assert (b > a && b < a + 1024);
+
+    // std containers on top of arena, they must not outlive the reset
+    {
+        ArenaString s {ArenaAllocator <char> (arena)};
+        for (int i = 0; i != 100; i++)
+            s.append ("0123456789");
+        assert (s.size () == 1000);
+        std::vector <int, ArenaAllocator <int>> v {ArenaAllocator <int> (arena)};
+        for (int i = 0; i != 100; i++)
+            v.push_back (i);
+        assert (v [99] == 99);
+
+        ArenaString *made = arena.make <ArenaString> ("made", ArenaAllocator <char> (arena));
+        assert (*made == "made");
+    }
+
+    // reset keeps the first chunk, so the next request costs no malloc
+    arena.reset ();
+    assert (arena.allocations () == 0);
+    assert (arena.chunks () == 0);
+    char *c = arena.copy ("again", 5);
+    assert (c == a);
+    assert (arena.chunks () == 0);
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,156 @@
+/*  =========================================================================
+    arena - Per-request monotonic memory arena
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <new>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+/**
+ * \class Arena
+ *
+ * \brief Monotonic memory arena for the lifetime of one request
+ *
+ * Memory is handed out by bumping a pointer in big chunks, deallocation
+ * is a no-op and everything is released at once by reset (). Server resets
+ * the arena after each mailbox message, so decode/render/MIME scratch
+ * buffers cost no malloc once the first chunk is warm.
+ *
+ * Destructors of objects created in the arena are NOT called.
+ */
+class Arena
+{
+    public:
+        static const size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+        explicit Arena (size_t chunk_size = DEFAULT_CHUNK_SIZE);
+        ~Arena ();
+
+        Arena (const Arena&) = delete;
+        Arena& operator= (const Arena&) = delete;
+
+        /** \brief allocate size bytes aligned to alignment */
+        void* allocate (size_t size, size_t alignment = alignof (std::max_align_t));
+
+        /** \brief copy data to arena, result is NULL terminated */
+        char* copy (const char *data, size_t size);
+
+        /** \brief construct object in the arena, destructor is never called */
+        template <typename T, typename... Args>
+        T* make (Args&&... args)
+        {
+            return new (allocate (sizeof (T), alignof (T))) T (std::forward <Args> (args)...);
+        }
+
+        /** \brief release all memory, first chunk is kept for the next request */
+        void reset ();
+
+        /** \brief number of allocations served since the last reset */
+        size_t allocations () const { return _allocations; }
+        /** \brief number of bytes allocated since the last reset */
+        size_t bytes () const { return _bytes; }
+        /** \brief number of chunks obtained from malloc since the last reset */
+        size_t chunks () const { return _chunks; }
+
+    protected:
+        char* chunk (size_t size);
+
+        size_t _chunk_size;
+        std::vector <char*> _blocks;
+        char *_first;
+        char *_ptr;
+        char *_end;
+        size_t _allocations;
+        size_t _bytes;
+        size_t _chunks;
+};
+
+/**
+ * \class ArenaAllocator
+ *
+ * \brief std allocator on top of Arena
+ */
+template <typename T>
+class ArenaAllocator
+{
+    public:
+        typedef T value_type;
+        typedef T* pointer;
+        typedef const T* const_pointer;
+        typedef T& reference;
+        typedef const T& const_reference;
+        typedef size_t size_type;
+        typedef ptrdiff_t difference_type;
+
+        template <typename U>
+        struct rebind { typedef ArenaAllocator <U> other; };
+
+        // allocator without arena falls back to the heap (COW std::string needs it)
+        ArenaAllocator (): _arena {NULL} {}
+        explicit ArenaAllocator (Arena& arena): _arena {&arena} {}
+
+        template <typename U>
+        ArenaAllocator (const ArenaAllocator <U>& other): _arena {other.arena ()} {}
+
+        T* allocate (size_t n, const void* = 0)
+        {
+            if (!_arena)
+                return static_cast <T*> (::operator new (n * sizeof (T)));
+            // std::string may put its header in front of the characters
+            return static_cast <T*> (_arena->allocate (n * sizeof (T), alignof (std::max_align_t)));
+        }
+
+        void deallocate (T *p, size_t)
+        {
+            if (!_arena)
+                ::operator delete (p);
+        }
+
+        size_t max_size () const { return size_t (-1) / sizeof (T); }
+
+        template <typename U, typename... Args>
+        void construct (U *p, Args&&... args) { new ((void*) p) U (std::forward <Args> (args)...); }
+
+        template <typename U>
+        void destroy (U *p) { p->~U (); }
+
+        Arena* arena () const { return _arena; }
+
+    protected:
+        Arena *_arena;
+};
+
+template <typename T, typename U>
+bool operator== (const ArenaAllocator <T>& a, const ArenaAllocator <U>& b) { return a.arena () == b.arena (); }
+
+template <typename T, typename U>
+bool operator!= (const ArenaAllocator <T>& a, const ArenaAllocator <U>& b) { return a.arena () != b.arena (); }
+
+typedef std::basic_string <char, std::char_traits <char>, ArenaAllocator <char>> ArenaString;
+
+void
+arena_test (bool verbose);
+
+#endif // ARENA_H_INCLUDED
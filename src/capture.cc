@@ -0,0 +1,384 @@
+/*  =========================================================================
+    capture - Binary capture of mailbox requests for replay
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    capture - Binary capture of mailbox requests for replay
+@discuss
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static const char MAGIC [] = "FTYCAP01";
+static const size_t MAGIC_SIZE = 8;
+
+enum FrameType {
+    FRAME_DATA = 0,
+    FRAME_ATTACHMENT = 1,
+    FRAME_BATCH_ITEM = 2
+};
+
+static void
+s_put (std::string& buffer, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i != bytes; i++)
+        buffer.push_back (static_cast <char> ((value >> (8 * i)) & 0xff));
+}
+
+static bool
+s_get (FILE *file, uint64_t& value, size_t bytes)
+{
+    unsigned char data [8];
+    if (fread (data, 1, bytes, file) != bytes)
+        return false;
+    value = 0;
+    for (size_t i = 0; i != bytes; i++)
+        value |= static_cast <uint64_t> (data [i]) << (8 * i);
+    return true;
+}
+
+// size of the file, 0 if it doesn't exist
+static uint64_t
+s_file_size (zframe_t *frame)
+{
+    std::string path ((const char*) zframe_data (frame), zframe_size (frame));
+    struct stat st;
+    return stat (path.c_str (), &st) == 0 ? st.st_size : 0;
+}
+
+CaptureWriter::CaptureWriter ():
+    _file {NULL},
+    _path {},
+    _dirty {false}
+{
+}
+
+CaptureWriter::~CaptureWriter ()
+{
+    close ();
+}
+
+int
+CaptureWriter::open (const std::string& path)
+{
+    close ();
+    int fd = ::open (path.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        log_error ("can't create capture file %s: %s", path.c_str (), strerror (errno));
+        return -1;
+    }
+    _file = fdopen (fd, "w");
+    if (!_file) {
+        ::close (fd);
+        return -1;
+    }
+    _path = path;
+    fwrite (MAGIC, 1, MAGIC_SIZE, _file);
+    fflush (_file);
+    return 0;
+}
+
+void
+CaptureWriter::close ()
+{
+    if (_file)
+        fclose (_file);
+    _file = NULL;
+    _path.clear ();
+    _dirty = false;
+}
+
+int
+CaptureWriter::write (const char *subject, zmsg_t *msg)
+{
+    if (!_file)
+        return -1;
+
+    std::string buffer;
+    buffer.reserve (zmsg_content_size (msg) + 64);
+    int64_t now = std::chrono::duration_cast <std::chrono::microseconds> (
+            std::chrono::system_clock::now ().time_since_epoch ()).count ();
+    s_put (buffer, static_cast <uint64_t> (now), 8);
+    size_t subject_size = std::min <size_t> (strlen (subject), 255);
+    s_put (buffer, subject_size, 1);
+    buffer.append (subject, subject_size);
+    s_put (buffer, std::min <size_t> (zmsg_size (msg), 0xffff), 2);
+
+    // [uuid|to|subject|body|headers|path1|path2|...], SENDMAIL_BATCH is
+    // [uuid|item1|item2|...], where each item is such an encoded message
+    bool attachments = (streq (subject, "SENDMAIL") || streq (subject, "SENDMAIL_ASYNC") || streq (subject, "SENDMAIL_EACH"))
+        && zmsg_size (msg) > 5;
+    bool items = streq (subject, "SENDMAIL_BATCH");
+    size_t index = 0;
+    for (zframe_t *frame = zmsg_first (msg); frame && index != 0xffff; frame = zmsg_next (msg), index++) {
+        bool attachment = attachments && index >= 5;
+        zmsg_t *item = items && index >= 1 ? zmsg_decode (zframe_data (frame), zframe_size (frame)) : NULL;
+        s_put (buffer, attachment ? FRAME_ATTACHMENT : item ? FRAME_BATCH_ITEM : FRAME_DATA, 1);
+        s_put (buffer, zframe_size (frame), 4);
+        buffer.append ((const char*) zframe_data (frame), zframe_size (frame));
+        if (attachment)
+            s_put (buffer, s_file_size (frame), 8);
+        if (item) {
+            size_t count = zmsg_size (item) > 5 ? std::min <size_t> (zmsg_size (item) - 5, 0xffff) : 0;
+            s_put (buffer, count, 2);
+            zframe_t *path = zmsg_first (item);
+            for (size_t i = 0; i != count + 5; i++, path = zmsg_next (item)) {
+                if (i < 5)
+                    continue;
+                s_put (buffer, i, 2);
+                s_put (buffer, s_file_size (path), 8);
+            }
+            zmsg_destroy (&item);
+        }
+    }
+
+    if (fwrite (buffer.data (), 1, buffer.size (), _file) != buffer.size ()) {
+        log_error ("can't write to capture file %s, capture stopped", _path.c_str ());
+        close ();
+        return -1;
+    }
+    _dirty = true;
+    return 0;
+}
+
+int
+CaptureWriter::flush ()
+{
+    if (!_file)
+        return -1;
+    if (fflush (_file) != 0) {
+        log_error ("can't write to capture file %s, capture stopped", _path.c_str ());
+        close ();
+        return -1;
+    }
+    _dirty = false;
+    return 0;
+}
+
+CaptureReader::CaptureReader ():
+    _file {NULL}
+{
+}
+
+CaptureReader::~CaptureReader ()
+{
+    if (_file)
+        fclose (_file);
+}
+
+int
+CaptureReader::open (const std::string& path)
+{
+    if (_file)
+        fclose (_file);
+    _file = fopen (path.c_str (), "r");
+    if (!_file) {
+        log_error ("can't open capture file %s: %s", path.c_str (), strerror (errno));
+        return -1;
+    }
+    char magic [MAGIC_SIZE];
+    if (fread (magic, 1, MAGIC_SIZE, _file) != MAGIC_SIZE || memcmp (magic, MAGIC, MAGIC_SIZE) != 0) {
+        log_error ("%s is not a capture file", path.c_str ());
+        fclose (_file);
+        _file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+bool
+CaptureReader::next (CaptureRecord& record)
+{
+    zmsg_destroy (&record.msg);
+    record.subject.clear ();
+    record.attachments.clear ();
+    record.items.clear ();
+    if (!_file)
+        return false;
+
+    uint64_t time, subject_size, frames;
+    if (!s_get (_file, time, 8) || !s_get (_file, subject_size, 1))
+        return false;
+    record.time = static_cast <int64_t> (time);
+    record.subject.resize (subject_size);
+    if (fread (&record.subject [0], 1, subject_size, _file) != subject_size || !s_get (_file, frames, 2))
+        return false;
+
+    record.msg = zmsg_new ();
+    for (size_t i = 0; i != frames; i++) {
+        uint64_t type, size, file_size;
+        if (!s_get (_file, type, 1) || !s_get (_file, size, 4))
+            return false;
+        zframe_t *frame = zframe_new (NULL, size);
+        if (size && fread (zframe_data (frame), 1, size, _file) != size) {
+            zframe_destroy (&frame);
+            return false;
+        }
+        zmsg_append (record.msg, &frame);
+        if (type == FRAME_ATTACHMENT) {
+            if (!s_get (_file, file_size, 8))
+                return false;
+            record.attachments.push_back (std::make_pair (i, file_size));
+        }
+        else
+        if (type == FRAME_BATCH_ITEM) {
+            uint64_t count, index;
+            if (!s_get (_file, count, 2))
+                return false;
+            std::vector <std::pair <size_t, uint64_t>> attachments;
+            for (uint64_t j = 0; j != count; j++) {
+                if (!s_get (_file, index, 2) || !s_get (_file, file_size, 8))
+                    return false;
+                attachments.push_back (std::make_pair (index, file_size));
+            }
+            if (!attachments.empty ())
+                record.items.push_back (std::make_pair (i, attachments));
+        }
+        else
+        if (type != FRAME_DATA)
+            return false;
+    }
+    return true;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+capture_test (bool verbose)
+{
+    printf (" * capture: ");
+
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    //  @selftest
+    std::string path = std::string (SELFTEST_DIR_RW) + "/capture.cap";
+    std::string attachment = std::string (SELFTEST_DIR_RW) + "/capture-attachment";
+    {
+        FILE *file = fopen (attachment.c_str (), "w");
+        assert (file);
+        for (int i = 0; i != 1000; i++)
+            fputc ('x', file);
+        fclose (file);
+    }
+
+    {
+        CaptureWriter writer;
+        assert (!writer.is_open ());
+        assert (writer.open (path) == 0);
+        assert (writer.is_open ());
+
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, "UUID1");
+        zmsg_addstr (msg, "joe@example.com");
+        zmsg_addstr (msg, "subject");
+        zmsg_addstr (msg, "body");
+        zmsg_addmem (msg, "\0\1", 2);
+        zmsg_addstr (msg, attachment.c_str ());
+        assert (!writer.dirty ());
+        assert (writer.write ("SENDMAIL", msg) == 0);
+        assert (writer.dirty ());
+        assert (writer.flush () == 0);
+        assert (!writer.dirty ());
+        zmsg_destroy (&msg);
+
+        msg = zmsg_new ();
+        zmsg_addstr (msg, "UUID2");
+        zmsg_addmem (msg, NULL, 0);
+        assert (writer.write ("SENDMAIL_ALERT", msg) == 0);
+        zmsg_destroy (&msg);
+
+        // attachments of batch items are recorded as well
+        msg = zmsg_new ();
+        zmsg_addstr (msg, "BATCH");
+        zmsg_t *item = zmsg_new ();
+        zmsg_addstr (item, "ITEM1");
+        zmsg_addstr (item, "joe@example.com");
+        zmsg_addstr (item, "subject");
+        zmsg_addstr (item, "body");
+        zmsg_addmem (item, "\0\1", 2);
+        zmsg_addstr (item, attachment.c_str ());
+        byte *buffer = NULL;
+        size_t size = zmsg_encode (item, &buffer);
+        zmsg_addmem (msg, buffer, size);
+        free (buffer);
+        zmsg_destroy (&item);
+        assert (writer.write ("SENDMAIL_BATCH", msg) == 0);
+        zmsg_destroy (&msg);
+        // rest is written by close
+    }
+
+    {
+        CaptureReader reader;
+        assert (reader.open (attachment) == -1);
+        assert (reader.open (path) == 0);
+
+        CaptureRecord record;
+        assert (reader.next (record));
+        assert (record.subject == "SENDMAIL");
+        assert (record.time > 0);
+        assert (zmsg_size (record.msg) == 6);
+        char *uuid = zmsg_popstr (record.msg);
+        assert (streq (uuid, "UUID1"));
+        zstr_free (&uuid);
+        // [to|subject|body|headers|path]
+        zframe_t *headers = zmsg_first (record.msg);
+        for (int i = 0; i != 3; i++)
+            headers = zmsg_next (record.msg);
+        assert (zframe_size (headers) == 2);
+        assert (record.attachments.size () == 1);
+        assert (record.attachments [0].first == 5);
+        assert (record.attachments [0].second == 1000);
+        int64_t first = record.time;
+
+        assert (reader.next (record));
+        assert (record.subject == "SENDMAIL_ALERT");
+        assert (record.time >= first);
+        assert (zmsg_size (record.msg) == 2);
+        assert (record.attachments.empty ());
+        assert (record.items.empty ());
+
+        assert (reader.next (record));
+        assert (record.subject == "SENDMAIL_BATCH");
+        assert (zmsg_size (record.msg) == 2);
+        assert (record.attachments.empty ());
+        assert (record.items.size () == 1);
+        assert (record.items [0].first == 1);
+        assert (record.items [0].second.size () == 1);
+        assert (record.items [0].second [0].first == 5);
+        assert (record.items [0].second [0].second == 1000);
+
+        assert (!reader.next (record));
+        assert (!record.msg);
+    }
+    unlink (path.c_str ());
+    unlink (attachment.c_str ());
+    //  @end
+
+    printf ("OK\n");
+}
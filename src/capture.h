@@ -0,0 +1,137 @@
+/*  =========================================================================
+    capture - Binary capture of mailbox requests for replay
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef CAPTURE_H_INCLUDED
+#define CAPTURE_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <utility>
+
+/*
+ * Capture file starts with magic "FTYCAP01", then records follow:
+ *
+ *  record  u64 time (us since epoch) | u8 subject size | subject |
+ *          u16 number of frames | frames
+ *  frame   u8 type | u32 size | data | u64 file size (attachment only) |
+ *          u16 number of attachments | (u16 index | u64 file size) for each
+ *          of them (batch item only)
+ *
+ * Frame type is 0 for data, 1 for the path of an attachment and 2 for an
+ * encoded item of SENDMAIL_BATCH. Index of an item attachment is the index
+ * of its path within the decoded item. Integers are little endian.
+ */
+
+/**
+ * \brief one captured mailbox request
+ */
+struct CaptureRecord {
+    // wall clock time when the request was received, us since epoch
+    int64_t time;
+    std::string subject;
+    // frames as sent by the client, owned by the record
+    zmsg_t *msg;
+    // (index of the frame with attachment path, size of the file when captured)
+    std::vector <std::pair <size_t, uint64_t>> attachments;
+    // (index of the frame with encoded batch item, its attachments as above)
+    std::vector <std::pair <size_t, std::vector <std::pair <size_t, uint64_t>>>> items;
+
+    CaptureRecord (): time {0}, subject {}, msg {NULL}, attachments {}, items {} {}
+    ~CaptureRecord () { zmsg_destroy (&msg); }
+
+    CaptureRecord (const CaptureRecord&) = delete;
+    CaptureRecord& operator= (const CaptureRecord&) = delete;
+};
+
+/**
+ * \class CaptureWriter
+ *
+ * \brief Record incoming mailbox requests to a capture file
+ *
+ * Paths of attachments (of SENDMAIL, SENDMAIL_ASYNC, SENDMAIL_EACH and of
+ * each item of SENDMAIL_BATCH) are stored with the size of the file, so
+ * replay on another machine can substitute files of the same size.
+ * Records are buffered and written out by flush, which the agent calls
+ * periodically, and by close.
+ * Captured requests contain whole emails, file is readable by owner only.
+ */
+class CaptureWriter
+{
+    public:
+        CaptureWriter ();
+        ~CaptureWriter ();
+
+        CaptureWriter (const CaptureWriter&) = delete;
+        CaptureWriter& operator= (const CaptureWriter&) = delete;
+
+        /** \brief create (truncate) the capture file, return 0 on success */
+        int open (const std::string& path);
+        void close ();
+
+        bool is_open () const { return _file != NULL; }
+        const std::string& path () const { return _path; }
+
+        /** \brief append request as received by the agent (without sender and subject frames) */
+        int write (const char *subject, zmsg_t *msg);
+
+        /** \brief write buffered records to the file, return 0 on success; capture stops on error */
+        int flush ();
+
+        /** \brief true when some records were not flushed yet */
+        bool dirty () const { return _dirty; }
+
+    protected:
+        FILE *_file;
+        std::string _path;
+        bool _dirty;
+};
+
+/**
+ * \class CaptureReader
+ *
+ * \brief Read requests from a capture file one by one
+ */
+class CaptureReader
+{
+    public:
+        CaptureReader ();
+        ~CaptureReader ();
+
+        CaptureReader (const CaptureReader&) = delete;
+        CaptureReader& operator= (const CaptureReader&) = delete;
+
+        /** \brief open the capture file and check its magic, return 0 on success */
+        int open (const std::string& path);
+
+        /** \brief read the next record, return false at the end of file or on error */
+        bool next (CaptureRecord& record);
+
+    protected:
+        FILE *_file;
+};
+
+void
+capture_test (bool verbose);
+
+#endif // CAPTURE_H_INCLUDED
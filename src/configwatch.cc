@@ -0,0 +1,147 @@
+/*  =========================================================================
+    configwatch - Watch config file for changes by inotify
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    configwatch - Watch config file for changes by inotify
+@discuss
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <fstream>
+#include <sys/inotify.h>
+
+// to ensure POSIX basename/dirname!!!
+#include <libgen.h>
+
+ConfigWatch::ConfigWatch (const std::string& path):
+    _fd {-1},
+    _name {}
+{
+    // POSIX basename/dirname may modify their argument
+    std::string copy {path};
+    _name = basename (&copy [0]);
+    copy = path;
+    std::string dir = dirname (&copy [0]);
+
+    _fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (_fd == -1) {
+        log_error ("inotify_init1 failed: %m");
+        return;
+    }
+
+    int wd = inotify_add_watch (_fd, dir.c_str (), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd == -1) {
+        log_error ("Can't watch directory %s: %m", dir.c_str ());
+        close (_fd);
+        _fd = -1;
+    }
+}
+
+ConfigWatch::~ConfigWatch ()
+{
+    if (_fd != -1)
+        close (_fd);
+}
+
+bool
+ConfigWatch::changed ()
+{
+    if (_fd == -1)
+        return false;
+
+    bool ret = false;
+    char buf [4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    while (true) {
+        ssize_t len = read (_fd, buf, sizeof (buf));
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+
+        for (char *ptr = buf; ptr < buf + len; ) {
+            const struct inotify_event *event = reinterpret_cast <const struct inotify_event*> (ptr);
+            if (event->len > 0 && _name == event->name)
+                ret = true;
+            ptr += sizeof (struct inotify_event) + event->len;
+        }
+    }
+    return ret;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+configwatch_test (bool verbose)
+{
+    printf (" * configwatch: ");
+
+    //  @selftest
+    // Note: If your selftest reads SCMed fixture data, please keep it in
+    // src/selftest-ro; if your test creates filesystem objects, please
+    // do so under src/selftest-rw.
+    std::string dir = "src/selftest-rw";
+    std::string path = dir + "/configwatch.cfg";
+    std::string tmp = dir + "/configwatch.cfg.tmp";
+    std::string other = dir + "/configwatch.other";
+    {
+        std::ofstream f {path};
+        f << "server\n";
+    }
+
+    ConfigWatch watch {path};
+    assert (watch.fd () != -1);
+    assert (!watch.changed ());
+
+    // unrelated file in the same directory
+    {
+        std::ofstream f {other};
+        f << "other\n";
+    }
+    assert (!watch.changed ());
+
+    // rewrite in place
+    {
+        std::ofstream f {path};
+        f << "server\n    language = en_US\n";
+    }
+    assert (watch.changed ());
+    assert (!watch.changed ());
+
+    // atomic replace, writing of the temporary file does not count
+    {
+        std::ofstream f {tmp};
+        f << "server\n    language = cs_CZ\n";
+    }
+    assert (!watch.changed ());
+    int r = rename (tmp.c_str (), path.c_str ());
+    assert (r == 0);
+    assert (watch.changed ());
+
+    unlink (path.c_str ());
+    unlink (other.c_str ());
+    //  @end
+
+    printf ("OK\n");
+}
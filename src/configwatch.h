@@ -0,0 +1,64 @@
+/*  =========================================================================
+    configwatch - Watch config file for changes by inotify
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef CONFIGWATCH_H_INCLUDED
+#define CONFIGWATCH_H_INCLUDED
+
+#include <string>
+
+/**
+ * \class ConfigWatch
+ *
+ * \brief Watch config file for changes by inotify
+ *
+ * The directory of the file is watched, not the file itself, so config
+ * replaced by atomic rename (editors, configuration tools) is detected
+ * as well as in place rewrite. Descriptor is non-blocking and meant to be
+ * registered in zloop/zpoller, so there are no wakeups while nothing changes.
+ */
+class ConfigWatch
+{
+    public:
+        explicit ConfigWatch (const std::string& path);
+        ~ConfigWatch ();
+
+        ConfigWatch (const ConfigWatch&) = delete;
+        ConfigWatch& operator= (const ConfigWatch&) = delete;
+
+        /** \brief inotify descriptor to poll on, -1 if watch can't be established */
+        int fd () const { return _fd; }
+
+        /**
+         * \brief consume pending events
+         *
+         * \return true if the watched file was written or replaced
+         */
+        bool changed ();
+
+    protected:
+        int _fd;
+        std::string _name;
+};
+
+void
+configwatch_test (bool verbose);
+
+#endif // CONFIGWATCH_H_INCLUDED
@@ -28,28 +28,38 @@
 
 #include "fty_email_classes.h"
 
-#include <sstream>
 #include <fstream>
+#include <iterator>
+#include <algorithm>
 #include <ctime>
 #include <stdio.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 // to ensure POSIX basename!!!
 // DO NOT REMOVE otherwise GNU basename can be used
 #include <libgen.h>
 
 #include <cxxtools/regex.h>
-#include <cxxtools/mime.h>
+
+Encryption
+SmtpSettings::encryption_from_string (const std::string& enc)
+{
+    if (strcasecmp ("starttls", enc.c_str ()) == 0)
+        return Encryption::STARTTLS;
+    if (strcasecmp ("tls", enc.c_str ()) == 0)
+        return Encryption::TLS;
+    return Encryption::NONE;
+}
 
 Smtp::Smtp():
-    _host {},
-    _port { "25" },
-    _from { "EatonProductFeedback@eaton.com" },
-    _encryption { Encryption::NONE },
-    _username {},
-    _password {},
-    _msmtp { "/usr/bin/msmtp" },
+    _settings {std::make_shared <const SmtpSettings> ()},
     _has_fn {false},
-    _verify_ca {false}
+    _arena {NULL},
+    _trace {NULL},
+    _session {},
+    _session_cfg {}
 {
     _magic = magic_open (MAGIC_MIME | MAGIC_ERROR | MAGIC_NO_CHECK_COMPRESS | MAGIC_NO_CHECK_TAR);
     if (!_magic)
@@ -64,19 +74,36 @@ Smtp::Smtp():
 
 Smtp::~Smtp ()
 {
+    end_session ();
     magic_close (_magic);
 }
 
-std::string Smtp::createConfigFile() const
+void Smtp::begin_session ()
+{
+    end_session ();
+    _session = settings ();
+    if (!_session->host.empty ())
+        _session_cfg = createConfigFile (*_session);
+}
+
+void Smtp::end_session ()
+{
+    if (!_session_cfg.empty ())
+        deleteConfigFile (_session_cfg);
+    _session_cfg.clear ();
+    _session.reset ();
+}
+
+std::string Smtp::createConfigFile(const SmtpSettings& settings) const
 {
     char filename[] = "/tmp/bios-msmtp-XXXXXX.cfg";
     int handle = mkstemps(filename,4);
     std::string line;
 
     line = "defaults\n";
-    const std::string verify_ca = _verify_ca ? "on" : "off";
+    const std::string verify_ca = settings.verify_ca ? "on" : "off";
 
-    switch (_encryption) {
+    switch (settings.encryption) {
     case Encryption::NONE:
         line += "tls off\n"
                 "tls_starttls off\n";
@@ -92,18 +119,18 @@ std::string Smtp::createConfigFile() const
                 "tls_starttls on\n";
         break;
     }
-    if (_username.empty()) {
+    if (settings.username.empty()) {
         line += "auth off\n";
     } else {
         line += "auth on\n"
-            "user " + _username + "\n"
-            "password " + _password + "\n";
+            "user " + settings.username + "\n"
+            "password " + settings.password + "\n";
     }
 
     line += "account default\n";
-    line += "host " + _host +"\n";
-    line += "port " + _port +"\n";
-    line += "from " + _from + "\n";
+    line += "host " + settings.host +"\n";
+    line += "port " + settings.port +"\n";
+    line += "from " + settings.from + "\n";
     ssize_t r = write (handle,  line.c_str(), line.size());
     if (r > 0 && (size_t) r != line.size ())
         log_error ("write to %s was truncated, expected %zu, written %zd", filename, line.size(), r);
@@ -118,11 +145,11 @@ void Smtp::deleteConfigFile(std::string &filename) const
     unlink (filename.c_str());
 }
 
-void Smtp::encryption(std::string enc)
+// uuid of the request for probes
+static const char*
+s_probe_uuid (const Trace *trace)
 {
-    if( strcasecmp ("starttls", enc.c_str()) == 0) encryption (Encryption::STARTTLS);
-    if( strcasecmp ("tls", enc.c_str()) == 0) encryption (Encryption::TLS);
-    encryption (Encryption::NONE);
+    return trace ? trace->uuid.c_str () : "";
 }
 
 void Smtp::sendmail(
@@ -131,26 +158,13 @@ void Smtp::sendmail(
         const std::string& body) const
 {
 
-    for (const auto& it : to)
-    {
-        zuuid_t *uuid = zuuid_new ();
-        zmsg_t *msg = fty_email_encode (
-            zuuid_str_canonical (uuid),
-            it.c_str (),
-            subject.c_str (),
-            NULL,
-            body.c_str (),
-            NULL
-        );
-        zuuid_destroy (&uuid);
-
-        // MVY: this is weird, horrible, ugly and hard to use.
-        //      Need to rething API for smtp_encode
-        //      BUT .. NEVER pass message with first uuid frame to msg2email
-        //      or BAD things will happen
-        char* cuuid = zmsg_popstr (msg); zstr_free (&cuuid);
-        sendmail (msg2email (&msg));
-    }
+    Email email;
+    email.to = to;
+    email.subject = subject;
+    email.body = body;
+
+    for (const auto& rendered : render_each (email))
+        sendmail (rendered);
 }
 
 void Smtp::sendmail(
@@ -171,37 +185,157 @@ void Smtp::sendmail(
     // for testing
     if (_has_fn) {
         _fn (data);
+        Metrics::global ().counter ("bytes_sent").add (data.size ());
         return;
     }
 
-    std::string cfg = createConfigFile();
-    if (_host.empty()) {
+    std::vector <struct iovec> iov (1);
+    iov [0].iov_base = const_cast <char*> (data.data ());
+    iov [0].iov_len = data.size ();
+    deliver (iov, data.size ());
+}
+
+void Smtp::sendmail(
+        const RenderedEmail& email,
+        const std::vector <std::string>& envelope) const
+{
+    // for testing
+    if (_has_fn) {
+        _fn (email.str ());
+        Metrics::global ().counter ("bytes_sent").add (email.size ());
         return;
     }
-    MlmSubprocess::Argv argv = { _msmtp, "-t", "-C", cfg };
+
+    std::vector <struct iovec> iov = email.iov ();
+    deliver (iov, email.size (), envelope);
+}
+
+void Smtp::sendmail(
+        const Email& email) const
+{
+    static Histogram& render_us = Metrics::global ().histogram ("render_us");
+
+    int64_t start = metrics_now_us ();
+    FTY_EMAIL_PROBE2 (render_start, s_probe_uuid (_trace), email.to.size ());
+    RenderedEmail rendered = render (email);
+    FTY_EMAIL_PROBE2 (render_end, s_probe_uuid (_trace), rendered.size ());
+    render_us.record (metrics_now_us () - start);
+    if (_trace)
+        _trace->mark (Trace::MIME);
+    sendmail (rendered, email.bcc);
+}
+
+std::vector <std::string> Smtp::sendmail_each(
+        const Email& email) const
+{
+    std::vector <RenderedEmail> copies = render_each (email);
+    std::vector <std::string> ret;
+    ret.reserve (copies.size ());
+    for (const auto& rendered : copies) {
+        try {
+            sendmail (rendered);
+            ret.emplace_back ();
+        }
+        catch (const std::runtime_error &re) {
+            ret.emplace_back (re.what ());
+        }
+    }
+    return ret;
+}
+
+// write all iovecs, handles partial writes and IOV_MAX
+// returns number of bytes written, which is less than expected on error
+static size_t
+s_writev_all (int fd, std::vector <struct iovec>& iov)
+{
+    size_t idx = 0;
+    size_t written = 0;
+    while (idx < iov.size ()) {
+        int count = static_cast <int> (std::min <size_t> (iov.size () - idx, IOV_MAX));
+        ssize_t r = ::writev (fd, &iov [idx], count);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error ("writev failed: %s", strerror (errno));
+            break;
+        }
+        written += r;
+        size_t left = static_cast <size_t> (r);
+        while (idx < iov.size () && left >= iov [idx].iov_len) {
+            left -= iov [idx].iov_len;
+            idx ++;
+        }
+        if (left > 0) {
+            iov [idx].iov_base = static_cast <char*> (iov [idx].iov_base) + left;
+            iov [idx].iov_len -= left;
+        }
+    }
+    return written;
+}
+
+void Smtp::deliver (
+        std::vector <struct iovec>& iov,
+        size_t size,
+        const std::vector <std::string>& envelope) const
+{
+    static Histogram& spawn_us = Metrics::global ().histogram ("spawn_us");
+    static Histogram& transport_us = Metrics::global ().histogram ("transport_us");
+    static Counter& bytes_sent = Metrics::global ().counter ("bytes_sent");
+
+    // snapshot is read once, reload during delivery does not affect it
+    std::shared_ptr <const SmtpSettings> settings = _session ? _session : this->settings ();
+    const std::string& msmtp = settings->msmtp;
+
+    if (settings->host.empty()) {
+        return;
+    }
+    // configuration of the session is deleted by end_session
+    bool own_cfg = _session_cfg.empty ();
+    std::string cfg = own_cfg ? createConfigFile(*settings) : _session_cfg;
+    MlmSubprocess::Argv argv = { msmtp, "-t", "-C", cfg };
+    if (!envelope.empty ()) {
+        argv.push_back ("--");
+        argv.insert (argv.end (), envelope.begin (), envelope.end ());
+    }
     MlmSubprocess::SubProcess proc{argv, MlmSubprocess::SubProcess::STDIN_PIPE |
             MlmSubprocess::SubProcess::STDOUT_PIPE |
             MlmSubprocess::SubProcess::STDERR_PIPE};
 
+    int64_t start = metrics_now_us ();
+    FTY_EMAIL_PROBE2 (transport_start, s_probe_uuid (_trace), size);
     bool bret = proc.run();
+    int64_t spawned = metrics_now_us ();
+    spawn_us.record (spawned - start);
+    if (_trace)
+        _trace->mark (Trace::CONNECT, spawned);
     if (!bret) {
+        FTY_EMAIL_PROBE3 (transport_end, s_probe_uuid (_trace), -1, 0);
+        if (own_cfg)
+            deleteConfigFile (cfg);
         throw std::runtime_error( \
-                _msmtp + " failed with exit code '" + \
+                msmtp + " failed with exit code '" + \
                 std::to_string(proc.getReturnCode()) + "'\nstderr:\n" + \
                 MlmSubprocess::read_all(proc.getStderr()));
     }
 
-    ssize_t wr = ::write(proc.getStdin(), data.c_str(), data.size());
-    if (wr != static_cast<ssize_t>(data.size())) {
-        log_warning("Email truncated, exp '%zu', piped '%zd'", data.size(), wr);
+    size_t wr = s_writev_all (proc.getStdin(), iov);
+    if (wr != size) {
+        log_warning("Email truncated, exp '%zu', piped '%zu'", size, wr);
     }
     ::close(proc.getStdin()); //EOF
 
     int ret = proc.wait();
-    deleteConfigFile (cfg);
+    // msmtp connects to the server after it is spawned, so this is connect + SMTP transaction
+    transport_us.record (metrics_now_us () - spawned);
+    bytes_sent.add (wr);
+    FTY_EMAIL_PROBE3 (transport_end, s_probe_uuid (_trace), ret, wr);
+    if (_trace && ret == 0)
+        _trace->mark (Trace::DATA);
+    if (own_cfg)
+        deleteConfigFile (cfg);
     if ( ret != 0 ) {
         throw std::runtime_error( \
-                _msmtp + " wait with exit code '" + \
+                msmtp + " wait with exit code '" + \
                 std::to_string(proc.getReturnCode()) + "'\nstderr:\n" + \
                 MlmSubprocess::read_all(proc.getStderr()));
     }
@@ -209,13 +343,39 @@ void Smtp::sendmail(
     ret = proc.getReturnCode();
     if (ret != 0) {
         throw std::runtime_error( \
-                _msmtp + " failed with exit code '" + \
+                msmtp + " failed with exit code '" + \
                 std::to_string(proc.getReturnCode()) + "'\nstderr:\n" + \
                 MlmSubprocess::read_all(proc.getStderr()));
     }
 
 }
 
+std::vector <struct iovec>
+RenderedEmail::iov () const
+{
+    std::vector <struct iovec> ret;
+    ret.reserve (_segments.size ());
+    for (const auto& segment : _segments) {
+        if (segment.size == 0)
+            continue;
+        struct iovec v;
+        v.iov_base = const_cast <char*> (segment.data);
+        v.iov_len = segment.size;
+        ret.push_back (v);
+    }
+    return ret;
+}
+
+std::string
+RenderedEmail::str () const
+{
+    std::string ret;
+    ret.reserve (_size);
+    for (const auto& segment : _segments)
+        ret.append (segment.data, segment.size);
+    return ret;
+}
+
 static bool
 s_is_text (const char* mime)
 {
@@ -223,105 +383,364 @@ s_is_text (const char* mime)
     return !strncmp (mime, "text", 4);
 }
 
-std::string
-Smtp::msg2email (zmsg_t **msg_p) const
+static std::string
+s_frame_str (zframe_t *frame)
+{
+    return std::string ((const char*) zframe_data (frame), zframe_size (frame));
+}
+
+static uint32_t
+s_get_number4 (const byte *needle)
+{
+    return ((uint32_t) needle [0] << 24)
+         | ((uint32_t) needle [1] << 16)
+         | ((uint32_t) needle [2] << 8)
+         |  (uint32_t) needle [3];
+}
+
+// read zhash_pack'ed frame in place, without building the zhash_t
+// format is number of items (4 bytes) and then for each
+// key length (1 byte), key, value length (4 bytes), value
+static void
+s_unpack_headers (zframe_t *frame, std::vector <std::pair <std::string, std::string>>& headers)
+{
+    const byte *needle = zframe_data (frame);
+    const byte *ceiling = needle + zframe_size (frame);
+    if (needle + 4 > ceiling)
+        return;
+    uint32_t nitems = s_get_number4 (needle);
+    needle += 4;
+    headers.reserve (nitems);
+    while (nitems-- && needle < ceiling) {
+        size_t key_size = *needle++;
+        if (needle + key_size + 4 > ceiling)
+            break;
+        const char *key = (const char*) needle;
+        needle += key_size;
+        size_t value_size = s_get_number4 (needle);
+        needle += 4;
+        if (needle + value_size > ceiling)
+            break;
+        headers.emplace_back (
+            std::piecewise_construct,
+            std::forward_as_tuple (key, key_size),
+            std::forward_as_tuple ((const char*) needle, value_size));
+        needle += value_size;
+    }
+}
+
+Email
+Email::decode (zmsg_t **msg_p)
 {
     assert (msg_p && *msg_p);
     zmsg_t *msg = *msg_p;
+    Email email;
 
-    std::stringstream buff;
-    cxxtools::MimeMultipart mime;
+    // frames are read in place, so each one is copied exactly once
+    zframe_t *frame = zmsg_first (msg);
+    if (frame) {
+        email.to.push_back (s_frame_str (frame));
+        frame = zmsg_next (msg);
+    }
+    if (frame) {
+        email.subject = s_frame_str (frame);
+        frame = zmsg_next (msg);
+    }
+    if (frame) {
+        email.body = s_frame_str (frame);
+        frame = zmsg_next (msg);
+    }
 
-    char *to = zmsg_popstr (msg);
-    char *subject = zmsg_popstr (msg);
-    std::string body = getIpAddr();
-    ZstrGuard bodyTemp (zmsg_popstr (msg));
-    body += bodyTemp.get();
+    // new protocol have more frames
+    if (frame) {
+        s_unpack_headers (frame, email.headers);
+        frame = zmsg_next (msg);
+    }
+
+    for (; frame != NULL; frame = zmsg_next (msg))
+        email.attachments.push_back (s_frame_str (frame));
+
+    zmsg_destroy (&msg);
+    *msg_p = NULL;
+    return email;
+}
 
-    mime.setHeader ("To", to);
-    mime.setHeader ("Subject", subject);
-    mime.addObject (body.c_str());
+// Boundary starts with "=_", which can't appear in quoted-printable nor base64
+// encoded parts, so it's safe to use the same one for all messages
+#define MIME_BOUNDARY "=_fty-email-part"
 
-    zstr_free (&to);
-    zstr_free (&subject);
+static const char BASE64_ALPHABET[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-    // new protocol have more frames
-    if (zmsg_size (msg) != 0) {
-        zframe_t *frame = zmsg_pop (msg);
-        zhash_t *headers = zhash_unpack (frame);
-        zframe_destroy (&frame);
-        zhash_autofree (headers);
-
-        for (char* value = (char*) zhash_first (headers);
-                   value != NULL;
-                   value = (char*) zhash_next (headers))
-        {
-            const char* key = zhash_cursor (headers);
-            mime.setHeader (key, value);
+// base64 with lines of 76 characters (RFC 2045)
+static void
+s_base64 (const ArenaString& data, ArenaString& ret)
+{
+    ret.reserve (ret.size () + (data.size () + 2) / 3 * 4 + (data.size () / 57 + 1) * 2);
+    size_t line = 0;
+    for (size_t i = 0; i < data.size (); i += 3) {
+        uint32_t n = static_cast <uint8_t> (data [i]) << 16;
+        if (i + 1 < data.size ())
+            n |= static_cast <uint8_t> (data [i + 1]) << 8;
+        if (i + 2 < data.size ())
+            n |= static_cast <uint8_t> (data [i + 2]);
+        ret.push_back (BASE64_ALPHABET [(n >> 18) & 0x3f]);
+        ret.push_back (BASE64_ALPHABET [(n >> 12) & 0x3f]);
+        ret.push_back (i + 1 < data.size () ? BASE64_ALPHABET [(n >> 6) & 0x3f] : '=');
+        ret.push_back (i + 2 < data.size () ? BASE64_ALPHABET [n & 0x3f] : '=');
+        line += 4;
+        if (line == 76) {
+            ret.append ("\r\n");
+            line = 0;
         }
-        zhash_destroy (&headers);
+    }
+    if (line != 0)
+        ret.append ("\r\n");
+}
 
+// quoted-printable with soft line breaks (RFC 2045), line ends are normalized to CRLF
+template <typename String>
+static void
+s_quoted_printable (const String& data, ArenaString& ret)
+{
+    static const char HEX[] = "0123456789ABCDEF";
+    ret.reserve (ret.size () + data.size () + data.size () / 8);
+    size_t line = 0;
+    for (size_t i = 0; i < data.size (); i++) {
+        unsigned char ch = static_cast <unsigned char> (data [i]);
+        if (ch == '\r' && i + 1 < data.size () && data [i + 1] == '\n')
+            continue;
+        if (ch == '\n') {
+            ret.append ("\r\n");
+            line = 0;
+            continue;
+        }
 
-        //NOTE: setLocale(LC_DATE, "C") should be called in outer scope
-        time_t t = ::time(NULL);
-        struct tm* tmp = ::localtime(&t);
-        char buf[256];
-        strftime(buf, sizeof(buf), "%a, %d %b %Y %T %z\n", tmp);
-        mime.setHeader ("Date", buf);
+        bool last_on_line = (i + 1 == data.size ()) || data [i + 1] == '\n' || data [i + 1] == '\r';
+        bool literal = (ch >= 33 && ch <= 126 && ch != '=')
+                    || ((ch == ' ' || ch == '\t') && !last_on_line);
+        size_t width = literal ? 1 : 3;
+        if (line + width > 75) {
+            ret.append ("=\r\n");
+            line = 0;
+        }
+        if (literal)
+            ret.push_back (static_cast <char> (ch));
+        else {
+            ret.push_back ('=');
+            ret.push_back (HEX [ch >> 4]);
+            ret.push_back (HEX [ch & 0x0f]);
+        }
+        line += width;
+    }
+}
 
-        while (zmsg_size (msg) != 0)
+// scratch buffer of one segment, it lives in the arena if there is one,
+// otherwise on the heap and the segment owns it
+class SegmentBuffer
+{
+    public:
+        SegmentBuffer (Arena *arena, size_t reserve):
+            _owner {},
+            _buffer {NULL}
         {
-            char* path = zmsg_popstr (msg);
-            const char* mime_type = magic_file (_magic, path);
-            if (!mime_type) {
-                log_warning ("Can't guess type for %s, using application/octet-stream", path);
-                mime_type = "application/octet-stream; charset=binary";
+            if (arena)
+                _buffer = arena->make <ArenaString> (ArenaAllocator <char> (*arena));
+            else {
+                _owner = std::make_shared <ArenaString> ();
+                _buffer = _owner.get ();
             }
+            _buffer->reserve (reserve);
+        }
+
+        ArenaString& str () { return *_buffer; }
+
+        void flush (RenderedEmail& email) {
+            email.append (_buffer->data (), _buffer->size (), _owner);
+        }
+
+    protected:
+        std::shared_ptr <ArenaString> _owner;
+        ArenaString *_buffer;
+};
+
+RenderedEmail
+Smtp::render_headers (const Email& email, const std::string& to) const
+{
+    SegmentBuffer buffer {_arena, 256 + to.size () + email.subject.size ()};
+    ArenaString& ret = buffer.str ();
+
+    ret.append ("To: ").append (to.data (), to.size ()).append ("\r\n");
+    ret.append ("Subject: ").append (email.subject.data (), email.subject.size ()).append ("\r\n");
+
+    //NOTE: setLocale(LC_DATE, "C") should be called in outer scope
+    time_t t = ::time(NULL);
+    struct tm* tmp = ::localtime(&t);
+    char buf[256];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %T %z", tmp);
+    ret.append ("Date: ").append (buf).append ("\r\n");
+
+    for (const auto& header : email.headers)
+        ret.append (header.first.data (), header.first.size ())
+           .append (": ")
+           .append (header.second.data (), header.second.size ())
+           .append ("\r\n");
+
+    ret.append (
+        "MIME-Version: 1.0\r\n"
+        "Content-Type: multipart/mixed; boundary=\"" MIME_BOUNDARY "\"\r\n"
+        "\r\n");
+
+    RenderedEmail rendered;
+    buffer.flush (rendered);
+    return rendered;
+}
 
-            std::ifstream ipath {path};
+RenderedEmail
+Smtp::render_body (const Email& email) const
+{
+    RenderedEmail ret;
+
+    ret.append_literal (
+        "--" MIME_BOUNDARY "\r\n"
+        "Content-Type: text/plain; charset=UTF-8\r\n"
+        "Content-Transfer-Encoding: quoted-printable\r\n"
+        "\r\n");
+    {
+        SegmentBuffer text {_arena, email.body.size () + email.body.size () / 8 + 64};
+        s_quoted_printable (getIpAddr (), text.str ());
+        s_quoted_printable (email.body, text.str ());
+        text.flush (ret);
+    }
 
-            if (s_is_text (mime_type))
-                mime.attachTextFile (ipath, basename (path), mime_type);
-            else
-                mime.attachBinaryFile (ipath, basename (path), mime_type);
+    for (const auto& attachment : email.attachments)
+    {
+        const char* path = attachment.c_str ();
+        const char* mime_type = magic_file (_magic, path);
+        if (!mime_type) {
+            log_warning ("Can't guess type for %s, using application/octet-stream", path);
+            mime_type = "application/octet-stream; charset=binary";
+        }
 
-            ipath.close ();
-            zstr_free (&path);
+        // raw content is scratch only, encoded part is what goes out
+        ArenaString content {_arena ? ArenaAllocator <char> (*_arena) : ArenaAllocator <char> ()};
+        std::ifstream ipath {path, std::ios::binary};
+        if (!ipath)
+            log_warning ("Can't read attachment %s", path);
+        else {
+            ipath.seekg (0, std::ios::end);
+            std::streamoff content_size = ipath.tellg ();
+            ipath.seekg (0, std::ios::beg);
+            if (content_size > 0) {
+                content.resize (static_cast <size_t> (content_size));
+                ipath.read (&content [0], content_size);
+                content.resize (static_cast <size_t> (ipath.gcount ()));
+            }
         }
+        ipath.close ();
+
+        // POSIX basename may modify its argument
+        std::string name {attachment};
+        bool text = s_is_text (mime_type);
+
+        SegmentBuffer part {_arena, 256 + content.size () * 4 / 3 + content.size () / 38};
+        ArenaString& part_str = part.str ();
+        part_str.append ("\r\n--" MIME_BOUNDARY "\r\n");
+        part_str.append ("Content-Type: ").append (mime_type).append ("\r\n");
+        part_str.append ("Content-Transfer-Encoding: ").append (text ? "quoted-printable" : "base64").append ("\r\n");
+        part_str.append ("Content-Disposition: attachment; filename=\"").append (basename (&name [0])).append ("\"\r\n");
+        part_str.append ("\r\n");
+        if (text)
+            s_quoted_printable (content, part_str);
+        else
+            s_base64 (content, part_str);
+        part.flush (ret);
     }
-    zmsg_destroy (&msg);
-    *msg_p = NULL;
 
-    buff << mime;
-    return buff.str ();
+    ret.append_literal ("\r\n--" MIME_BOUNDARY "--\r\n");
+    return ret;
 }
 
-std::string
-sms_email_address (
-        const std::string& gw_template,
-        const std::string& phone_number)
+std::vector <RenderedEmail>
+Smtp::render_each (const Email& email) const
 {
-    std::string ret = gw_template;
-    std::string clean_phone_number;
-    for (const char ch : phone_number) {
-        if (::isdigit (ch))
-            clean_phone_number.push_back (ch);
+    static Histogram& render_us = Metrics::global ().histogram ("render_us");
+
+    // MIME body is the same for everyone, only header block differs
+    int64_t start = metrics_now_us ();
+    FTY_EMAIL_PROBE2 (render_start, s_probe_uuid (_trace), email.to.size ());
+    RenderedEmail mime_body = render_body (email);
+    std::vector <RenderedEmail> ret;
+    ret.reserve (email.to.size ());
+    for (const auto& to : email.to) {
+        ret.push_back (render_headers (email, to));
+        ret.back ().append (mime_body);
     }
+    FTY_EMAIL_PROBE2 (render_end, s_probe_uuid (_trace), mime_body.size ());
+    render_us.record (metrics_now_us () - start);
+    if (_trace)
+        _trace->mark (Trace::MIME);
+    return ret;
+}
 
-    ssize_t idx = clean_phone_number.size () -1;
-    for (;;) {
-        auto it = ret.find_last_of ('#');
-        if (it == std::string::npos)
-            break;
-        if (idx < 0)
-            throw std::logic_error ("Cannot apply number '" + phone_number + "' onto template '" + gw_template + "'. Not enough numbers in phone number");
-        ret [it] = clean_phone_number [idx];
-        idx --;
+RenderedEmail
+Smtp::render (const Email& email) const
+{
+    std::string to;
+    for (const auto& recipient : email.to) {
+        if (!to.empty ())
+            to += ", ";
+        to += recipient;
     }
+    // empty group, so blind recipients don't see each other
+    if (to.empty () && !email.bcc.empty ())
+        to = "undisclosed-recipients:;";
 
+    RenderedEmail ret = render_headers (email, to);
+    ret.append (render_body (email));
     return ret;
 }
 
+std::string
+Smtp::msg2email (zmsg_t **msg_p) const
+{
+    return render (Email::decode (msg_p)).str ();
+}
+
+SmsTemplate::SmsTemplate (const std::string& gw_template):
+    _template {gw_template},
+    _digits {}
+{
+    for (size_t i = _template.size (); i != 0; i--) {
+        if (_template [i - 1] == '#')
+            _digits.push_back (i - 1);
+    }
+}
+
+std::string
+SmsTemplate::address (const std::string& phone_number) const
+{
+    // last # gets the last digit of the number
+    std::string ret = _template;
+    auto digit = phone_number.rbegin ();
+    for (size_t pos : _digits) {
+        while (digit != phone_number.rend () && !::isdigit (*digit))
+            ++digit;
+        if (digit == phone_number.rend ())
+            throw std::logic_error ("Cannot apply number '" + phone_number + "' onto template '" + _template + "'. Not enough numbers in phone number");
+        ret [pos] = *digit++;
+    }
+    return ret;
+}
+
+std::string
+sms_email_address (
+        const std::string& gw_template,
+        const std::string& phone_number)
+{
+    return SmsTemplate (gw_template).address (phone_number);
+}
+
 SmtpError
     msmtp_stderr2code (
         const std::string &inp)
@@ -411,6 +830,22 @@ email_test (bool verbose)
     catch (std::logic_error &e) {
     }
 
+    // test case 06 compiled template is reused for many numbers
+    {
+        SmsTemplate gw {"0#####@hyper.mobile"};
+        assert (gw.address ("+79 (0) 123456") == "023456@hyper.mobile");
+        assert (gw.address ("654321") == "054321@hyper.mobile");
+        assert (gw.address ("1-2-3-4-5") == "012345@hyper.mobile");
+        assert (gw.str () == "0#####@hyper.mobile");
+        try {
+            gw.address ("1234");
+            assert (false);
+        }
+        catch (std::logic_error &e) {
+        }
+        assert (SmsTemplate ().address ("123").empty ());
+    }
+
     // test of msmtp_stderr2code
     // test case 3 DNSFailed
     assert (msmtp_stderr2code ("msmtp: cannot locate host NOTmail.etn.com: Name or service not known\nmsmtp: could not send mail (account default from config)") == SmtpError::DNSFailed);
@@ -440,9 +875,152 @@ email_test (bool verbose)
 
     Smtp smtp {};
     char* uuid = zmsg_popstr (email_msg); zstr_free (&uuid);
+    zmsg_t *email_msg_dup = zmsg_dup (email_msg);
     std::string email = smtp.msg2email (&email_msg);
+    assert (!email_msg);
     log_debug ("E M A I L:=\n%s\n", email.c_str ());
 
+    // test of Email::decode
+    Email decoded = Email::decode (&email_msg_dup);
+    assert (!email_msg_dup);
+    assert (decoded.to.size () == 1);
+    assert (decoded.to [0] == "to");
+    assert (decoded.subject == "subject");
+    assert (decoded.body == "body");
+    assert (decoded.headers.size () == 1);
+    assert (decoded.headers [0].first == "Foo");
+    assert (decoded.headers [0].second == "bar");
+    assert (decoded.attachments.size () == 2);
+    assert (decoded.attachments [0] == str_SELFTEST_DIR_RW + "/file1");
+    assert (decoded.attachments [1] == str_SELFTEST_DIR_RW + "/file2.txt");
+
+    Email moved = std::move (decoded);
+    assert (moved.body == "body");
+    RenderedEmail rendered = smtp.render (moved);
+    std::string rendered_str = rendered.str ();
+    assert (rendered_str.size () == rendered.size ());
+    assert (rendered_str.find ("Subject: subject\r\n") != std::string::npos);
+    assert (rendered_str.find ("Foo: bar\r\n") != std::string::npos);
+    assert (rendered_str.find ("filename=\"file1\"") != std::string::npos);
+    assert (rendered_str.find ("filename=\"file2.txt\"") != std::string::npos);
+    // binary attachment MZ\0\0\0\0\0\0 is base64 encoded
+    assert (rendered_str.find ("TVoAAAAAAAA=") != std::string::npos);
+
+    // body is shared between recipients, only the header block differs
+    moved.to = {"joe@example.com", "jane@example.com"};
+    std::vector <RenderedEmail> copies = smtp.render_each (moved);
+    assert (copies.size () == 2);
+    const RenderedEmail& copy1 = copies [0];
+    const RenderedEmail& copy2 = copies [1];
+    assert (copy1.segments ().size () == copy2.segments ().size ());
+    for (size_t i = 1; i != copy1.segments ().size (); i++)
+        assert (copy1.segments () [i].data == copy2.segments () [i].data);
+    assert (copy1.str ().find ("To: joe@example.com\r\n") == 0);
+    assert (copy2.str ().find ("To: jane@example.com\r\n") == 0);
+
+    // scatter/gather delivery, writes whole message in one writev
+    int fds [2];
+    int r = pipe (fds);
+    assert (r == 0);
+    std::vector <struct iovec> iov = copy1.iov ();
+    size_t written = s_writev_all (fds [1], iov);
+    assert (written == copy1.size ());
+    close (fds [1]);
+    std::string piped = MlmSubprocess::read_all (fds [0]);
+    close (fds [0]);
+    assert (piped == copy1.str ());
+
+    // blind recipients are passed to msmtp, headers don't disclose them
+    {
+        Email blind;
+        blind.bcc = {"011111@hyper.mobile", "022222@hyper.mobile"};
+        blind.subject = "subject";
+        blind.body = "body";
+        std::string headers = smtp.render (blind).str ();
+        headers.erase (headers.find ("\r\n\r\n"));
+        assert (headers.find ("To: undisclosed-recipients:;\r\n") == 0);
+        assert (headers.find ("011111") == std::string::npos);
+        assert (headers.find ("022222") == std::string::npos);
+
+        std::string script = str_SELFTEST_DIR_RW + "/fake-msmtp.sh";
+        std::ofstream fscript {script};
+        fscript << "#!/bin/sh\necho \"$@\" > " << str_SELFTEST_DIR_RW << "/fake-msmtp.args\ncat > /dev/null\n";
+        fscript.close ();
+        chmod (script.c_str (), 0755);
+        Smtp blind_smtp;
+        blind_smtp.host ("localhost");
+        blind_smtp.msmtp_path (script);
+        blind_smtp.sendmail (blind);
+        std::ifstream fargs {str_SELFTEST_DIR_RW + "/fake-msmtp.args"};
+        std::string args;
+        std::getline (fargs, args);
+        assert (args.find ("-t -C ") == 0);
+        assert (args.find (" -- 011111@hyper.mobile 022222@hyper.mobile") != std::string::npos);
+        unlink (script.c_str ());
+        unlink ((str_SELFTEST_DIR_RW + "/fake-msmtp.args").c_str ());
+    }
+
+    // with arena, all rendering scratch buffers come from it
+    {
+        Arena arena;
+        smtp.arena (&arena);
+        RenderedEmail in_arena = smtp.render (moved);
+        assert (in_arena.str ().find ("TVoAAAAAAAA=") != std::string::npos);
+        assert (in_arena.str ().find ("Foo: bar\r\n") != std::string::npos);
+        assert (arena.chunks () == 1);
+        for (const auto& segment : in_arena.segments ())
+            assert (!segment.owner);
+        size_t allocations = arena.allocations ();
+        assert (allocations > 0);
+
+        // second request reuses the same chunk
+        arena.reset ();
+        in_arena = smtp.render (moved);
+        assert (arena.chunks () == 0);
+        assert (arena.allocations () == allocations);
+        smtp.arena (NULL);
+    }
+
+    // settings are published as immutable snapshots
+    {
+        Smtp settings_smtp;
+        std::shared_ptr <const SmtpSettings> before = settings_smtp.settings ();
+        assert (before->port == "25");
+        settings_smtp.host ("mail.example.com");
+        settings_smtp.encryption ("StartTLS");
+        std::shared_ptr <const SmtpSettings> after = settings_smtp.settings ();
+        assert (before->host.empty ());
+        assert (before->encryption == Encryption::NONE);
+        assert (after->host == "mail.example.com");
+        assert (after->encryption == Encryption::STARTTLS);
+        assert (after->port == "25");
+
+        std::shared_ptr <SmtpSettings> next = std::make_shared <SmtpSettings> (*after);
+        next->language = "cs_CZ";
+        settings_smtp.settings (next);
+        assert (settings_smtp.settings ()->language == "cs_CZ");
+        assert (after->language == DEFAULT_LANGUAGE);
+    }
+
+    // headers are read from zhash frame in place
+    {
+        zhash_t *many = zhash_new ();
+        zhash_update (many, "X-One", (void*) "1");
+        zhash_update (many, "X-Two", (void*) "");
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, "to");
+        zmsg_addstr (msg, "subject");
+        zmsg_addstr (msg, "body");
+        zframe_t *frame = zhash_pack (many);
+        zmsg_append (msg, &frame);
+        zhash_destroy (&many);
+        Email email = Email::decode (&msg);
+        assert (email.headers.size () == 2);
+        for (const auto& header : email.headers)
+            assert ((header.first == "X-One" && header.second == "1")
+                 || (header.first == "X-Two" && header.second == ""));
+    }
+
     //  @end
     printf ("OK\n");
 }
@@ -44,9 +44,15 @@ Example:
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <cstring>
+#include <utility>
 #include <functional>
+#include <sys/uio.h>
 #include <fty_common_mlm_subprocess.h>
 
+class Trace;
+
 /**
  * \class security
  *
@@ -72,6 +78,7 @@ enum class Encryption {
 8: if SSL is requiered by the smtp server
 9: if sender address is not specified
 10: if the reason is unknown
+11: if the server is busy and request should be retried later (fty-email extension)
 */
 
 enum class SmtpError {
@@ -85,7 +92,158 @@ enum class SmtpError {
     UnknownCA = 7,
     SSLRequired = 8,
     NoSenderAddress = 9,
-    Unknown = 10
+    Unknown = 10,
+    Busy = 11
+};
+
+/**
+ * \class Email
+ *
+ * \brief Email to be sent
+ *
+ * Typed form of SENDMAIL request. It is decoded from zmsg only once at the
+ * mailbox boundary and then moved around, never copied.
+ */
+class Email
+{
+    public:
+        Email () = default;
+        Email (Email&&) = default;
+        Email& operator= (Email&&) = default;
+        Email (const Email&) = delete;
+        Email& operator= (const Email&) = delete;
+
+        /**
+         * \brief decode email from zmq message
+         *
+         * Format of message is [$to|$subject|$body|$headers:zhash_t|attachment1|...]
+         * (see fty_email_encode) without the first uuid frame.
+         * Message is destroyed.
+         */
+        static Email decode (zmsg_t **msg_p);
+
+        std::vector <std::string> to;
+        // envelope only recipients, they are not listed in headers
+        std::vector <std::string> bcc;
+        std::string subject;
+        std::vector <std::pair <std::string, std::string>> headers;
+        std::string body;
+        // paths of files to be attached
+        std::vector <std::string> attachments;
+};
+
+/**
+ * \class RenderedEmail
+ *
+ * \brief Email rendered as a list of buffers
+ *
+ * Header block, body and encoded attachments are kept as separate
+ * segments and passed to msmtp by writev, so they are never concatenated.
+ * Segments are immutable and shared, so one rendered body can be sent
+ * to many recipients with different header blocks.
+ *
+ * Segment either owns its data (owner is set), or borrows it from a string
+ * literal, zmq frame or Arena, which must outlive the rendered email.
+ */
+class RenderedEmail
+{
+    public:
+        struct Segment {
+            const char *data;
+            size_t size;
+            std::shared_ptr <const void> owner;
+        };
+
+        /** \brief append borrowed data, owner (if any) keeps it alive */
+        void append (const char *data, size_t size, std::shared_ptr <const void> owner = nullptr) {
+            _size += size;
+            _segments.push_back (Segment {data, size, std::move (owner)});
+        }
+        /** \brief append string literal */
+        void append_literal (const char *literal) {
+            append (literal, strlen (literal));
+        }
+        /** \brief append data owned by the segment */
+        void append (std::string data) {
+            auto owner = std::make_shared <const std::string> (std::move (data));
+            append (owner->data (), owner->size (), owner);
+        }
+        void append (const RenderedEmail& other) {
+            for (const auto& segment : other._segments)
+                append (segment.data, segment.size, segment.owner);
+        }
+
+        const std::vector <Segment>& segments () const { return _segments; }
+
+        /** \brief total size in bytes */
+        size_t size () const { return _size; }
+
+        /** \brief iovec array pointing to segments, valid while this object lives */
+        std::vector <struct iovec> iov () const;
+
+        /** \brief concatenate all segments (for testing) */
+        std::string str () const;
+
+    protected:
+        std::vector <Segment> _segments;
+        size_t _size = 0;
+};
+
+/**
+ * \class SmsTemplate
+ *
+ * \brief Template of SMS gateway address compiled to positions of digits
+ *
+ * Template is scanned for # characters only once (at LOAD), so mapping of
+ * phone number to address only copies the digits, see sms_email_address.
+ */
+class SmsTemplate
+{
+    public:
+        SmsTemplate () = default;
+        explicit SmsTemplate (const std::string& gw_template);
+
+        /**
+         * \brief email address of the gateway for phone number
+         * \throws std::logic_error if phone number does not have enough digits
+         */
+        std::string address (const std::string& phone_number) const;
+
+        const std::string& str () const { return _template; }
+
+    protected:
+        std::string _template;
+        // positions of # in the template, from the last one
+        std::vector <size_t> _digits;
+};
+
+/**
+ * \class SmtpSettings
+ *
+ * \brief Snapshot of Smtp configuration
+ *
+ * Snapshot is immutable once published by Smtp::settings, so it can be read
+ * without a lock. Reload builds a new snapshot and swaps the pointer;
+ * deliveries in flight finish with the snapshot they started with.
+ */
+struct SmtpSettings {
+    std::string host;
+    std::string port = "25";
+    std::string from = "EatonProductFeedback@eaton.com";
+    Encryption encryption = Encryption::NONE;
+    std::string username;
+    std::string password;
+    std::string msmtp = "/usr/bin/msmtp";
+    bool verify_ca = false;
+    // template of SMS gateway address, see sms_email_address
+    std::string gw_template;
+    // gw_template compiled at LOAD
+    SmsTemplate sms_template;
+    // language of alert notifications
+    std::string language = DEFAULT_LANGUAGE;
+
+    /** \brief parse encryption (NONE|TLS|STARTTLS), case insensitive, NONE for unknown values */
+    static Encryption encryption_from_string (const std::string& enc);
 };
 
 /**
@@ -109,27 +267,63 @@ class Smtp
 
         ~Smtp ();
 
+        /** \brief current settings snapshot, safe to call from any thread */
+        std::shared_ptr <const SmtpSettings> settings () const { return std::atomic_load (&_settings); }
+
+        /** \brief publish new settings snapshot, safe to call from any thread */
+        void settings (std::shared_ptr <const SmtpSettings> settings) { std::atomic_store (&_settings, std::move (settings)); }
+
+        // Setters below copy the current snapshot, change one field and publish
+        // the copy. Concurrent setters are not serialized, build a snapshot and
+        // publish it at once to change more fields from several threads.
+
         /** \brief set the SMTP server address */
-        void host (const std::string& host) { _host = host; };
+        void host (const std::string& host) { update ([&host] (SmtpSettings& s) { s.host = host; }); };
 
         /** \brief set the SMTP server port. Default is 25.*/
-        void port (const std::string& port) { _port = port; };
+        void port (const std::string& port) { update ([&port] (SmtpSettings& s) { s.port = port; }); };
 
         /** \brief set the "mail from" address */
-        void from (const std::string& from) { _from = from; };
+        void from (const std::string& from) { update ([&from] (SmtpSettings& s) { s.from = from; }); };
 
         /** \brief set username for smtp authentication */
-        void username (const std::string& username) { _username = username; };
+        void username (const std::string& username) { update ([&username] (SmtpSettings& s) { s.username = username; }); };
 
         /** \brief set password for smtp authentication */
-        void password (const std::string& password) { _password = password; };
+        void password (const std::string& password) { update ([&password] (SmtpSettings& s) { s.password = password; }); };
 
         /** \brief set the encryption for SMTP communication (NONE|TLS|STARTTLS) */
-        void encryption (std::string enc);
-        void encryption (Encryption enc) { _encryption = enc; };
+        void encryption (std::string enc) { encryption (SmtpSettings::encryption_from_string (enc)); }
+        void encryption (Encryption enc) { update ([enc] (SmtpSettings& s) { s.encryption = enc; }); };
+
+        /**
+         * \brief set arena for rendering scratch buffers
+         *
+         * Rendered email then borrows memory from the arena, so it must be
+         * sent before the arena is reset. NULL means heap.
+         */
+        void arena (Arena *arena) { _arena = arena; }
+
+        /**
+         * \brief set trace of the request being sent, MIME, CONNECT and DATA
+         * stages are marked in it. NULL turns tracing off.
+         */
+        void trace (Trace *trace) { _trace = trace; }
+
+        /**
+         * \brief start session of several deliveries
+         *
+         * Deliveries until end_session () use the same settings snapshot and
+         * the same msmtp configuration file, so it is written only once. msmtp
+         * still sends each email over its own SMTP connection.
+         */
+        void begin_session ();
+
+        /** \brief end session started by begin_session (), delete its msmtp configuration */
+        void end_session ();
 
         /** \brief turn on or of the CA verification */
-        void verify_ca (bool verify) { _verify_ca = verify; }
+        void verify_ca (bool verify) { update ([verify] (SmtpSettings& s) { s.verify_ca = verify; }); }
 
         /**
          * \brief set alternative path for msmtp
@@ -137,7 +331,7 @@ class Smtp
          * \param path  path to msmtp binary to be called
          *
          */
-        void msmtp_path (const std::string& msmtp_path) { _msmtp = msmtp_path; };
+        void msmtp_path (const std::string& msmtp_path) { update ([&msmtp_path] (SmtpSettings& s) { s.msmtp = msmtp_path; }); };
 
         /**
          * \brief set sendmail testing function
@@ -193,6 +387,74 @@ class Smtp
         void sendmail(
                 const std::string& data) const;
 
+        /**
+         * \brief send the email
+         *
+         * Technically this put email to msmtp's outgoing queue
+         * \param email     email to be rendered and sent
+         *
+         * \throws std::runtime_error for msmtp invocation errors
+         */
+        void sendmail(
+                const Email& email) const;
+
+        /**
+         * \brief send the rendered email
+         *
+         * Segments are written to msmtp by writev, envelope recipients are
+         * added to the ones from headers
+         *
+         * \throws std::runtime_error for msmtp invocation errors
+         */
+        void sendmail(
+                const RenderedEmail& email,
+                const std::vector <std::string>& envelope = std::vector <std::string> ()) const;
+
+        /**
+         * \brief send personal copy of the email to each recipient in email.to
+         *
+         * Each copy has its own To: header, MIME body and attachments are
+         * rendered once and shared by all copies (see render_each).
+         *
+         * \return error of each recipient in order of email.to, empty if delivered
+         */
+        std::vector <std::string> sendmail_each(
+                const Email& email) const;
+
+        /**
+         * \brief render email
+         *
+         * Function creates a multipart message, which can be sent
+         */
+        RenderedEmail
+            render (const Email& email) const;
+
+        /**
+         * \brief render email headers for given recipient(s)
+         *
+         * \param to        value of To: header
+         */
+        RenderedEmail
+            render_headers (const Email& email, const std::string& to) const;
+
+        /**
+         * \brief render personal copy of email for each recipient in email.to
+         *
+         * MIME body is rendered once, copies share its segments and differ
+         * only in the header block, so N copies cost one render_body and N
+         * render_headers.
+         */
+        std::vector <RenderedEmail>
+            render_each (const Email& email) const;
+
+        /**
+         * \brief render MIME body of email (body and attachments)
+         *
+         * Result is the same for all recipients, so it can be shared.
+         */
+        RenderedEmail
+            render_body (const Email& email) const;
+
         /**
          * \brief convert zmq message to email string
          *
@@ -205,26 +467,40 @@ class Smtp
 
     protected:
 
+        /**
+         * \brief pipe iovec array to msmtp, envelope are additional recipients
+         */
+        void deliver (
+                std::vector <struct iovec>& iov,
+                size_t size,
+                const std::vector <std::string>& envelope = std::vector <std::string> ()) const;
+
+        /** \brief copy the current snapshot, modify it by fn and publish the copy */
+        template <typename Fn>
+        void update (Fn fn) {
+            std::shared_ptr <SmtpSettings> copy = std::make_shared <SmtpSettings> (*settings ());
+            fn (*copy);
+            settings (std::move (copy));
+        }
+
         /**
          * \brief create msmtp config file
          */
-        std::string createConfigFile() const;
+        std::string createConfigFile(const SmtpSettings& settings) const;
         /**
          * \brief delete msmtp config file
          */
         void deleteConfigFile(std::string &filename) const;
 
-        std::string _host;
-        std::string _port;
-        std::string _from;
-        Encryption _encryption;
-        std::string _username;
-        std::string _password;
-        std::string _msmtp;
+        std::shared_ptr <const SmtpSettings> _settings;
         bool _has_fn;
-        bool _verify_ca;
         std::function <void(const std::string&)> _fn;
         magic_t _magic;
+        Arena *_arena;
+        Trace *_trace;
+        // snapshot and msmtp configuration of the session, empty out of session
+        std::shared_ptr <const SmtpSettings> _session;
+        std::string _session_cfg;
 };
 
 /**
@@ -30,6 +30,9 @@
 #include <fty_common_translation.h>
 #include "fty_email_classes.h"
 
+#include <map>
+#include <mutex>
+
 /* This is what this code is intended to do:
  * - calling TRANSLATE_ME on template returns this kind of JSON:
  *   { "key" : "{{var1}} alert on {{var2}}\nfrom the rule {{var3}} is active!", "variables" : {"var1" : "__severity__", "var2" : "__assetname__", "var3" : "__rulename__"}}
@@ -67,106 +70,198 @@ from the rule %s was resolved", \
 
 
 // ----------------------------------------------------------------------------
-// static helper functions
+// helper functions
+
+// templates of notifications translated to one language
+struct Templates
+{
+    std::string body_active;
+    std::string subject_active;
+    std::string body_resolved;
+    std::string subject_resolved;
+};
 
+// fty-common-translation has one language for the whole process and can't look
+// up texts of other languages, so templates of the default language and of the
+// languages of contacts are translated by change_translation_language () when
+// the configuration is loaded, and the send path only reads them; descriptions
+// come with alerts, so the send path can translate them to the default language
+// only, switching the language there would race with other translations
+static std::mutex s_translation_mutex;
+static std::string s_translation_language = DEFAULT_LANGUAGE;
+static std::map <std::string, Templates> s_templates;
+
+// translate text (JSON with key and variables) to the current language of the library
 static std::string
+s_translate (const char *text)
+{
+    char *translated = translation_get_translated_text (text);
+    if (!translated)
+        return std::string ();
+    std::string result (translated);
+    zstr_free (&translated);
+    return result;
+}
+
+// return templates of language, the ones of default language if it wasn't prepared
+static Templates
+s_templates_of (const std::string& language)
+{
+    std::lock_guard <std::mutex> lock (s_translation_mutex);
+    auto it = s_templates.find (language);
+    if (it == s_templates.end ())
+        it = s_templates.find (s_translation_language);
+    if (it != s_templates.end ())
+        return it->second;
+    // library was initialized, but no configuration loaded yet
+    return Templates {
+        s_translate (BODY_ACTIVE.c_str ()),
+        s_translate (SUBJECT_ACTIVE.c_str ()),
+        s_translate (BODY_RESOLVED.c_str ()),
+        s_translate (SUBJECT_RESOLVED.c_str ())};
+}
+
+void
 replace_tokens (
-        const std::string& text,
-        const std::string& pattern,
-        const std::string& replacement)
+        std::string& text,
+        const char *pattern,
+        const char *replacement)
 {
-    std::string result = text;
+    size_t pattern_len = strlen (pattern);
+    size_t replacement_len = strlen (replacement);
     size_t pos = 0;
-    while( ( pos = result.find(pattern, pos) ) != std::string::npos){
-        result.replace(pos, pattern.length(), replacement);
-        pos += replacement.length();
+    while( ( pos = text.find(pattern, pos, pattern_len) ) != std::string::npos){
+        text.replace(pos, pattern_len, replacement, replacement_len);
+        pos += replacement_len;
     }
-    return result;
 }
 
 static std::string
-s_generateEmailBodyResolved (fty_proto_t *alert, const std::string& extname)
-{
-    char *result_char = translation_get_translated_text (BODY_RESOLVED.c_str ());
-    std::string result(result_char);
-    zstr_free (&result_char); 
-
-    result = replace_tokens (result, "__rulename__", fty_proto_rule (alert));
-    result = replace_tokens (result, "__assetname__", extname);
-    char *description_char = translation_get_translated_text (fty_proto_description (alert));
-    std::string description (description_char);
-    zstr_free (&description_char);
-    result = replace_tokens (result, "__description__", description.c_str ());
+s_generateEmailBodyResolved (fty_proto_t *alert, const std::string& extname, const std::string& description, const std::string& language)
+{
+    std::string result = s_templates_of (language).body_resolved;
+
+    replace_tokens (result, "__rulename__", fty_proto_rule (alert));
+    replace_tokens (result, "__assetname__", extname.c_str ());
+    replace_tokens (result, "__description__", description.c_str ());
     return result;
 }
 
 static std::string
-s_generateEmailBodyActive (fty_proto_t *alert, const std::string& priority, const std::string& extname)
-{
-    char *result_char = translation_get_translated_text (BODY_ACTIVE.c_str ());
-    std::string result(result_char);
-    zstr_free (&result_char); 
-
-    result = replace_tokens (result, "__rulename__", fty_proto_rule (alert));
-    result = replace_tokens (result, "__assetname__", extname);
-    char *description_char = translation_get_translated_text (fty_proto_description (alert));
-    std::string description (description_char);
-    zstr_free (&description_char);
-    result = replace_tokens (result, "__description__", description.c_str ());
-    result = replace_tokens (result, "__priority__", priority);
-    result = replace_tokens (result, "__severity__", fty_proto_severity (alert));
-    result = replace_tokens (result, "__state__", fty_proto_state (alert));
+s_generateEmailBodyActive (fty_proto_t *alert, const std::string& priority, const std::string& extname, const std::string& description, const std::string& language)
+{
+    std::string result = s_templates_of (language).body_active;
+
+    replace_tokens (result, "__rulename__", fty_proto_rule (alert));
+    replace_tokens (result, "__assetname__", extname.c_str ());
+    replace_tokens (result, "__description__", description.c_str ());
+    replace_tokens (result, "__priority__", priority.c_str ());
+    replace_tokens (result, "__severity__", fty_proto_severity (alert));
+    replace_tokens (result, "__state__", fty_proto_state (alert));
     return result;
 }
 
 static std::string
-s_generateEmailSubjectResolved (fty_proto_t *alert, const std::string &extname)
+s_generateEmailSubjectResolved (fty_proto_t *alert, const std::string &extname, const std::string& language)
 {
-    char *result_char = translation_get_translated_text (SUBJECT_RESOLVED.c_str ());
-    std::string result (result_char);
-    zstr_free (&result_char);
-    result = replace_tokens (result, "__rulename__", fty_proto_rule (alert));
-    result = replace_tokens (result, "__assetname__", extname);
+    std::string result = s_templates_of (language).subject_resolved;
+    replace_tokens (result, "__rulename__", fty_proto_rule (alert));
+    replace_tokens (result, "__assetname__", extname.c_str ());
     return result;
 }
 
 static std::string
-s_generateEmailSubjectActive (fty_proto_t *alert, const std::string& priority, const std::string& extname)
-{
-    char *result_char = translation_get_translated_text (SUBJECT_ACTIVE.c_str ());
-    std::string result (result_char);
-    zstr_free (&result_char);
-    result = replace_tokens (result, "__rulename__", fty_proto_rule (alert));
-    result = replace_tokens (result, "__assetname__", extname);
-    char *description_char = translation_get_translated_text (fty_proto_description (alert));
-    std::string description (description_char);
-    zstr_free (&description_char);
-    result = replace_tokens (result, "__description__", description.c_str ());
-    result = replace_tokens (result, "__priority__", priority);
-    result = replace_tokens (result, "__severity__", fty_proto_severity (alert));
-    result = replace_tokens (result, "__state__", fty_proto_state (alert));
+s_generateEmailSubjectActive (fty_proto_t *alert, const std::string& priority, const std::string& extname, const std::string& description, const std::string& language)
+{
+    std::string result = s_templates_of (language).subject_active;
+    replace_tokens (result, "__rulename__", fty_proto_rule (alert));
+    replace_tokens (result, "__assetname__", extname.c_str ());
+    replace_tokens (result, "__description__", description.c_str ());
+    replace_tokens (result, "__priority__", priority.c_str ());
+    replace_tokens (result, "__severity__", fty_proto_severity (alert));
+    replace_tokens (result, "__state__", fty_proto_state (alert));
     return result;
 }
 
 // ----------------------------------------------------------------------------
 // header functions
 
+bool
+change_translation_language (const std::string& language, const std::vector <std::string>& languages)
+{
+    std::lock_guard <std::mutex> lock (s_translation_mutex);
+    s_templates.clear ();
+    for (const std::string& other : languages) {
+        if (other == language || s_templates.count (other))
+            continue;
+        if (translation_change_language (other.c_str ()) != TE_OK) {
+            log_warning ("Can't translate to %s, its contacts get the default language", other.c_str ());
+            continue;
+        }
+        s_templates [other] = Templates {
+            s_translate (BODY_ACTIVE.c_str ()),
+            s_translate (SUBJECT_ACTIVE.c_str ()),
+            s_translate (BODY_RESOLVED.c_str ()),
+            s_translate (SUBJECT_RESOLVED.c_str ())};
+    }
+    // library stays in the default language, the old one if the new can't be loaded
+    bool changed = translation_change_language (language.c_str ()) == TE_OK;
+    if (changed)
+        s_translation_language = language;
+    else
+        translation_change_language (s_translation_language.c_str ());
+    s_templates [s_translation_language] = Templates {
+        s_translate (BODY_ACTIVE.c_str ()),
+        s_translate (SUBJECT_ACTIVE.c_str ()),
+        s_translate (BODY_RESOLVED.c_str ()),
+        s_translate (SUBJECT_RESOLVED.c_str ())};
+    return changed;
+}
+
 std::string
-generate_body (fty_proto_t *alert, const std::string& priority, const std::string& extname)
+translation_language (const std::string& language)
+{
+    std::lock_guard <std::mutex> lock (s_translation_mutex);
+    if (s_templates.count (language))
+        return language;
+    return s_translation_language;
+}
+
+std::string
+translate_description (const char *description)
+{
+    std::lock_guard <std::mutex> lock (s_translation_mutex);
+    return s_translate (description);
+}
+
+std::string
+generate_body (fty_proto_t *alert, const std::string& priority, const std::string& extname, const std::string& description, const std::string& language)
 {
     if (streq (fty_proto_state (alert), "RESOLVED")) {
-        return s_generateEmailBodyResolved (alert, extname);
+        return s_generateEmailBodyResolved (alert, extname, description, language);
     }
-    return s_generateEmailBodyActive (alert, priority, extname);
+    return s_generateEmailBodyActive (alert, priority, extname, description, language);
 }
 
 std::string
-generate_subject (fty_proto_t *alert, const std::string& priority, const std::string& extname)
+generate_body (fty_proto_t *alert, const std::string& priority, const std::string& extname)
+{
+    return generate_body (alert, priority, extname, translate_description (fty_proto_description (alert)));
+}
+
+std::string
+generate_subject (fty_proto_t *alert, const std::string& priority, const std::string& extname, const std::string& description, const std::string& language)
 {
     if (streq (fty_proto_state (alert), "RESOLVED")) {
-        return s_generateEmailSubjectResolved (alert, extname);
+        return s_generateEmailSubjectResolved (alert, extname, language);
     }
-    return s_generateEmailSubjectActive (alert, priority, extname);
+    return s_generateEmailSubjectActive (alert, priority, extname, description, language);
+}
+
+std::string
+generate_subject (fty_proto_t *alert, const std::string& priority, const std::string& extname)
+{
+    return generate_subject (alert, priority, extname, translate_description (fty_proto_description (alert)));
 }
 
 
@@ -23,15 +23,47 @@
 #define EMAILCONFIGURATION_H_INCLUDED
 
 #include <string>
+#include <vector>
+
+// change default language of translations and prepare templates of notifications
+// in languages of contacts, return false if the default one can't be loaded
+bool
+change_translation_language (const std::string& language,
+        const std::vector <std::string>& languages = std::vector <std::string> ());
+
+// return language notifications for language are rendered in, the default one
+// if language wasn't prepared by change_translation_language
+std::string
+translation_language (const std::string& language);
+
+// translate alert description ({"key": ..., "variables": ...} JSON) to the default
+// language, fty-common-translation can't look up other languages without switching
+// the one of the whole process
+std::string
+translate_description (const char *description);
 
 std::string
 generate_body (fty_proto_t *alert, const std::string& priority, const std::string& extname);
 
+// description is alert description already passed through translate_description
+std::string
+generate_body (fty_proto_t *alert, const std::string& priority, const std::string& extname, const std::string& description,
+        const std::string& language = std::string ());
+
 std::string
 generate_subject (fty_proto_t *alert, const std::string& priority, const std::string& extname);
 
+// description is alert description already passed through translate_description
+std::string
+generate_subject (fty_proto_t *alert, const std::string& priority, const std::string& extname, const std::string& description,
+        const std::string& language = std::string ());
+
 std::string getIpAddr ();
 
+// replace all occurrences of pattern in text, in place
+void
+replace_tokens (std::string& text, const char *pattern, const char *replacement);
+
 void
 emailconfiguration_test (bool verbose);
 
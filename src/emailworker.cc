@@ -0,0 +1,869 @@
+/*  =========================================================================
+    emailworker - Worker actor sending emails for the fty_email_server dispatcher
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    emailworker - Worker actor sending emails for the fty_email_server dispatcher
+@discuss
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <string>
+#include <vector>
+#include <cctype>
+#include <algorithm>
+#include <functional>
+#include <fty_common_macros.h>
+
+static void
+s_notify (
+          Smtp& smtp,
+          RenderCache& render_cache,
+          const std::string& language,
+          const char *priority,
+          const char *extname,
+          const std::string& contact,
+          fty_proto_t *alert,
+          Trace *trace)
+{
+    if (!priority || streq (priority, ""))
+        throw std::runtime_error ("Empty priority");
+    else if (!extname || streq (extname, ""))
+        throw std::runtime_error ("Empty asset name");
+    else if (contact.empty ())
+        throw std::runtime_error ("Empty contact");
+    else {
+        const RenderedAlert& rendered = render_cache.get (alert, priority, extname, language);
+        if (trace)
+            trace->mark (Trace::RENDER);
+        smtp.sendmail(
+                contact,
+                rendered.subject,
+                rendered.body
+                );
+    }
+}
+
+// split comma separated list of contacts, blanks around contacts are dropped
+static std::vector <std::string>
+s_contacts (const char *list)
+{
+    std::vector <std::string> ret;
+    if (!list)
+        return ret;
+    const char *p = list;
+    while (*p) {
+        const char *end = strchr (p, ',');
+        if (!end)
+            end = p + strlen (p);
+        const char *first = p;
+        const char *last = end;
+        while (first < last && isspace ((unsigned char) *first))
+            first ++;
+        while (last > first && isspace ((unsigned char) last [-1]))
+            last --;
+        if (last > first)
+            ret.emplace_back (first, last - first);
+        p = *end ? end + 1 : end;
+    }
+    return ret;
+}
+
+// contact may state its language as "$contact;$language", the suffix is cut off
+// return the language of contact, or fallback when it has none
+static std::string
+s_language (std::string& contact, const std::string& fallback)
+{
+    size_t pos = contact.rfind (';');
+    if (pos == std::string::npos)
+        return fallback;
+    std::vector <std::string> language = s_contacts (contact.c_str () + pos + 1);
+    contact.erase (pos);
+    while (!contact.empty () && isspace ((unsigned char) contact.back ()))
+        contact.pop_back ();
+    return language.empty () ? fallback : language.front ();
+}
+
+// fan-out requests get a record of each recipient, the first record (of the
+// request) is the template and it is dropped by s_mailbox once there are others
+static void
+s_add_record (std::vector <DeliveryRecord>& records, const char *uuid, const char *recipient, int32_t code)
+{
+    DeliveryRecord record = records.front ();
+    DeliveryRecord::copy (record.uuid, uuid);
+    DeliveryRecord::copy (record.recipient, recipient);
+    record.code = code;
+    records.push_back (record);
+}
+
+// send alert to each contact in its language, SMS contacts through the gateway
+// alert is rendered once per language, e-mails of one language share the MIME
+// body (see Smtp::sendmail_each); all SMS of one language go to the
+// gateway as one email with many blind recipients, so they cost one msmtp session
+// status [$contact|$code|$message] of each is added to the reply
+// return number of contacts, which were not notified
+static size_t
+s_fanout (
+        Smtp& smtp,
+        const SmtpSettings& settings,
+        RenderCache& render_cache,
+        fty_proto_t *alert,
+        const char *priority,
+        const char *extname,
+        std::vector <std::string>& contacts,
+        bool sms,
+        zmsg_t *reply,
+        Arena& arena,
+        std::vector <DeliveryRecord>& records,
+        const char *uuid,
+        Trace *trace)
+{
+    static Histogram& sms_batch = Metrics::global ().histogram ("sms_batch");
+
+    // contacts grouped by language, in order of the first appearance
+    std::vector <std::pair <std::string, std::vector <size_t>>> groups;
+    for (size_t i = 0; i != contacts.size (); i++) {
+        std::string language = s_language (contacts [i], settings.language);
+        auto it = std::find_if (groups.begin (), groups.end (),
+                [&language] (const std::pair <std::string, std::vector <size_t>>& group) { return group.first == language; });
+        if (it == groups.end ())
+            it = groups.emplace (groups.end (), language, std::vector <size_t> ());
+        it->second.push_back (i);
+    }
+
+    // error of each contact, empty if it was notified
+    std::vector <std::string> errors (contacts.size ());
+    for (const auto& group : groups) {
+        const RenderedAlert& rendered = render_cache.get (alert, priority, extname, group.first);
+        if (trace)
+            trace->mark (Trace::RENDER);
+        Email email;
+        email.subject = rendered.subject;
+        email.body = rendered.body;
+        if (!sms) {
+            // personal copies share one rendered MIME body
+            for (size_t i : group.second)
+                email.to.push_back (contacts [i]);
+            std::vector <std::string> copies = smtp.sendmail_each (email);
+            for (size_t j = 0; j != copies.size (); j++)
+                errors [group.second [j]] = copies [j];
+            arena.reset ();
+            continue;
+        }
+
+        std::vector <size_t> batch;
+        for (size_t i : group.second) {
+            try {
+                email.bcc.push_back (settings.sms_template.address (contacts [i]));
+                batch.push_back (i);
+            }
+            catch (const std::exception &re) {
+                errors [i] = re.what ();
+            }
+        }
+        if (batch.empty ())
+            continue;
+        sms_batch.record (batch.size ());
+        try {
+            smtp.sendmail (email);
+        }
+        catch (const std::exception &re) {
+            // one SMTP transaction, so all its recipients share the outcome
+            for (size_t i : batch)
+                errors [i] = re.what ();
+        }
+        arena.reset ();
+    }
+
+    size_t failed = 0;
+    for (size_t i = 0; i != contacts.size (); i++) {
+        const std::string& contact = contacts [i];
+        zmsg_addstr (reply, contact.c_str ());
+        if (errors [i].empty ()) {
+            s_add_record (records, uuid, contact.c_str (), 0);
+            zmsg_addstr (reply, "0");
+            zmsg_addstr (reply, "OK");
+            continue;
+        }
+        log_error ("Sending of %s alert to %s failed : %s", sms ? "SMS" : "e-mail", contact.c_str (), errors [i].c_str ());
+        failed ++;
+        int32_t code = static_cast <int32_t> (msmtp_stderr2code (errors [i]));
+        s_add_record (records, uuid, contact.c_str (), code);
+        FTY_EMAIL_PROBE3 (error, uuid, code, errors [i].c_str ());
+        Metrics::global ().counter ("alert_errors").add ();
+        zmsg_addstrf (reply, "%" PRId32, code);
+        zmsg_addstr (reply, UTF8::escape (errors [i]).c_str ());
+    }
+    return failed;
+}
+
+// pop frame as NULL terminated string allocated in the arena
+static const char*
+s_popstr (zmsg_t *msg, Arena& arena)
+{
+    zframe_t *frame = zmsg_pop (msg);
+    if (!frame)
+        return NULL;
+    const char *ret = arena.copy ((const char*) zframe_data (frame), zframe_size (frame));
+    zframe_destroy (&frame);
+    return ret;
+}
+
+// pop frame with pointer, as sent by zsock_send "p"
+static void*
+s_popptr (zmsg_t *msg)
+{
+    zframe_t *frame = zmsg_pop (msg);
+    void *ret = NULL;
+    if (frame && zframe_size (frame) == sizeof (void*))
+        memcpy (&ret, zframe_data (frame), sizeof (void*));
+    zframe_destroy (&frame);
+    return ret;
+}
+
+// send one email [$to|$subject|$body|...] or [$data], message may be taken over
+// return 0 if it was sent, otherwise the error code and (escaped) message
+static uint32_t
+s_sendmail (
+        const char *name,
+        Smtp& smtp,
+        zmsg_t **zmessage_p,
+        const char *uuid,
+        Trace *trace,
+        DeliveryRecord& record,
+        std::string& error)
+{
+    try {
+        if (zmsg_size (*zmessage_p) == 1) {
+            // whole email is in the frame, only From: line is prepended
+            // frame is borrowed, zmessage lives until the email is sent
+            zframe_t *frame = zmsg_first (*zmessage_p);
+            RenderedEmail data;
+            data.append (getIpAddr ());
+            data.append ((const char*) zframe_data (frame), zframe_size (frame));
+            if (trace)
+                trace->mark (Trace::DECODE);
+            log_debug ("%s:\tsmtp.sendmail (%zu bytes)", name, data.size ());
+            smtp.sendmail (data);
+        }
+        else {
+            Email email = Email::decode (zmessage_p);
+            if (trace)
+                trace->mark (Trace::DECODE);
+            if (!email.to.empty ())
+                DeliveryRecord::copy (record.recipient, email.to.front ().c_str ());
+            log_debug ("%s:\tsmtp.sendmail (to=%s, subject=%s, attachments=%zu)",
+                    name,
+                    email.to.empty () ? "" : email.to.front ().c_str (),
+                    email.subject.c_str (),
+                    email.attachments.size ());
+            smtp.sendmail (email);
+        }
+        return 0;
+    }
+    catch (const std::runtime_error &re) {
+        log_debug ("%s:\tgot std::runtime_error, e.what ()=%s", name, re.what ());
+        uint32_t code = static_cast <uint32_t> (msmtp_stderr2code (re.what ()));
+        record.code = static_cast <int32_t> (code);
+        FTY_EMAIL_PROBE3 (error, uuid, code, re.what ());
+        Metrics::global ().counter ("smtp_errors." + std::to_string (code)).add ();
+        error = UTF8::escape (re.what ());
+        return code;
+    }
+}
+
+// process one mailbox message and destroy it, reply (if any) is sent to the pipe
+// stages are marked to the trace, if any, outcome is filled to the records,
+// one for the request or one for each recipient of fan-out requests
+static void
+s_mailbox (
+        zsock_t *pipe,
+        const char *name,
+        Smtp& smtp,
+        RenderCache& render_cache,
+        Arena& arena,
+        zmsg_t **zmessage_p,
+        Trace *trace,
+        std::vector <DeliveryRecord>& records)
+{
+    // decoders take the message over, so it is owned by local variable
+    zmsg_t *zmessage = *zmessage_p;
+    *zmessage_p = NULL;
+    records.assign (1, DeliveryRecord {});
+    // reference is valid until records of recipients are added
+    DeliveryRecord& record = records.front ();
+    record.size = zmsg_content_size (zmessage);
+
+    char *sender = zmsg_popstr (zmessage);
+    char *subject = zmsg_popstr (zmessage);
+    std::string topic = subject ? subject : "";
+    zstr_free (&subject);
+    DeliveryRecord::copy (record.subject, topic.c_str ());
+
+    log_debug ("%s:\tMAILBOX DELIVER, subject=%s", name, topic.c_str ());
+
+    char *uuid = zmsg_popstr (zmessage);
+    if (!uuid) {
+        log_error ("UUID frame is missing from zmessage, ignoring");
+        zstr_free (&sender);
+        zmsg_destroy (&zmessage);
+        return;
+    }
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, uuid);
+    DeliveryRecord::copy (record.uuid, uuid);
+    const char *reply_subject = NULL;
+
+    if (topic == "SENDMAIL" || topic == "SENDMAIL_ASYNC") {
+        std::string error;
+        uint32_t code = s_sendmail (name, smtp, &zmessage, uuid, trace, record, error);
+        zmsg_addstrf (reply, "%" PRIu32, code);
+        zmsg_addstr (reply, code == 0 ? "OK" : error.c_str ());
+        reply_subject = code == 0 ? "SENDMAIL-OK" : "SENDMAIL-ERR";
+    }
+    else if (topic == "SENDMAIL_BATCH") {
+        // items share one settings snapshot and msmtp configuration
+        zmsg_t *statuses = zmsg_new ();
+        size_t failed = 0;
+        smtp.begin_session ();
+        zframe_t *frame;
+        while ((frame = zmsg_pop (zmessage)) != NULL) {
+            zmsg_t *item = zmsg_decode (zframe_data (frame), zframe_size (frame));
+            zframe_destroy (&frame);
+            char *item_uuid = item ? zmsg_popstr (item) : NULL;
+            std::string error = "Malformed item of the batch";
+            uint32_t code = static_cast <uint32_t> (SmtpError::Unknown);
+            DeliveryRecord item_record = records.front ();
+            if (item_uuid)
+                code = s_sendmail (name, smtp, &item, item_uuid, trace, item_record, error);
+            DeliveryRecord::copy (item_record.uuid, item_uuid);
+            item_record.code = static_cast <int32_t> (code);
+            records.push_back (item_record);
+            // rendered item is sent, its scratch memory is reused by the next one
+            arena.reset ();
+            if (code != 0)
+                failed ++;
+            zmsg_addstr (statuses, item_uuid ? item_uuid : "");
+            zmsg_addstrf (statuses, "%" PRIu32, code);
+            zmsg_addstr (statuses, code == 0 ? "OK" : error.c_str ());
+            zstr_free (&item_uuid);
+            zmsg_destroy (&item);
+        }
+        smtp.end_session ();
+        zmsg_addstrf (reply, "%zu", failed);
+        while ((frame = zmsg_pop (statuses)) != NULL)
+            zmsg_append (reply, &frame);
+        zmsg_destroy (&statuses);
+        reply_subject = "SENDMAIL_BATCH";
+    }
+    else if (topic == "SENDMAIL_EACH") {
+        // one personal copy for each recipient, MIME body is rendered only once
+        Email email = Email::decode (&zmessage);
+        if (trace)
+            trace->mark (Trace::DECODE);
+        email.to = s_contacts (email.to.empty () ? NULL : email.to.front ().c_str ());
+        if (email.to.empty ()) {
+            log_error ("%s:\tSENDMAIL_EACH without recipient", name);
+            record.code = static_cast <int32_t> (SmtpError::Unknown);
+            zmsg_addstr (reply, "ERROR");
+            zmsg_addstr (reply, "No recipient");
+        }
+        else {
+            log_debug ("%s:\tsmtp.sendmail_each (to=%zu, subject=%s, attachments=%zu)",
+                    name,
+                    email.to.size (),
+                    email.subject.c_str (),
+                    email.attachments.size ());
+            smtp.begin_session ();
+            std::vector <std::string> errors = smtp.sendmail_each (email);
+            smtp.end_session ();
+            size_t failed = 0;
+            zmsg_t *statuses = zmsg_new ();
+            for (size_t i = 0; i != errors.size (); i++) {
+                zmsg_addstr (statuses, email.to [i].c_str ());
+                if (errors [i].empty ()) {
+                    s_add_record (records, uuid, email.to [i].c_str (), 0);
+                    zmsg_addstr (statuses, "0");
+                    zmsg_addstr (statuses, "OK");
+                    continue;
+                }
+                failed ++;
+                uint32_t code = static_cast <uint32_t> (msmtp_stderr2code (errors [i]));
+                s_add_record (records, uuid, email.to [i].c_str (), static_cast <int32_t> (code));
+                FTY_EMAIL_PROBE3 (error, uuid, code, errors [i].c_str ());
+                Metrics::global ().counter ("smtp_errors." + std::to_string (code)).add ();
+                zmsg_addstrf (statuses, "%" PRIu32, code);
+                zmsg_addstr (statuses, UTF8::escape (errors [i]).c_str ());
+            }
+            zmsg_addstrf (reply, "%zu", failed);
+            zframe_t *frame;
+            while ((frame = zmsg_pop (statuses)) != NULL)
+                zmsg_append (reply, &frame);
+            zmsg_destroy (&statuses);
+        }
+        reply_subject = "SENDMAIL_EACH";
+    }
+    else if (topic == "SENDMAIL_ALERT" || topic == "SENDSMS_ALERT") {
+        const char *priority = s_popstr (zmessage, arena);
+        const char *extname = s_popstr (zmessage, arena);
+        const char *contact = s_popstr (zmessage, arena);
+        fty_proto_t *alert = fty_proto_decode (&zmessage);
+        if (trace)
+            trace->mark (Trace::DECODE);
+        std::shared_ptr <const SmtpSettings> settings = smtp.settings ();
+        std::string converted_contact = contact == NULL ? "" : contact;
+        std::string language = s_language (converted_contact, settings->language);
+        DeliveryRecord::copy (record.recipient, converted_contact.c_str ());
+
+        try {
+            if (topic == "SENDSMS_ALERT") {
+                log_debug ("gw_template = %s", settings->gw_template.c_str ());
+                log_debug ("contact = %s", converted_contact.c_str ());
+                std::string _contact = settings->sms_template.address (converted_contact);
+                s_notify (smtp, render_cache, language, priority, extname, _contact, alert, trace);
+            }
+            else {
+                s_notify (smtp, render_cache, language, priority, extname, converted_contact, alert, trace);
+            }
+            zmsg_addstr (reply, "OK");
+        }
+        catch (const std::exception &re) {
+            log_error ("Sending of e-mail/SMS alert failed : %s", re.what ());
+            record.code = static_cast <int32_t> (msmtp_stderr2code (re.what ()));
+            FTY_EMAIL_PROBE3 (error, uuid, record.code, re.what ());
+            Metrics::global ().counter ("alert_errors").add ();
+            zmsg_addstr (reply, "ERROR");
+            zmsg_addstr (reply, re.what ());
+        }
+        reply_subject = (topic == "SENDMAIL_ALERT") ? "SENDMAIL_ALERT" : "SENDSMS_ALERT";
+        fty_proto_destroy (&alert);
+    }
+    else if (topic == "NOTIFY_ALERT") {
+        const char *priority = s_popstr (zmessage, arena);
+        const char *extname = s_popstr (zmessage, arena);
+        std::vector <std::string> emails = s_contacts (s_popstr (zmessage, arena));
+        std::vector <std::string> phones = s_contacts (s_popstr (zmessage, arena));
+        fty_proto_t *alert = fty_proto_decode (&zmessage);
+        if (trace)
+            trace->mark (Trace::DECODE);
+        std::shared_ptr <const SmtpSettings> settings = smtp.settings ();
+        DeliveryRecord::copy (record.recipient, !emails.empty () ? emails.front ().c_str () : !phones.empty () ? phones.front ().c_str () : "");
+
+        if (!alert || !priority || streq (priority, "") || !extname || streq (extname, "") || (emails.empty () && phones.empty ())) {
+            const char *reason = !alert ? "Malformed alert" : !priority || streq (priority, "") ? "Empty priority"
+                : !extname || streq (extname, "") ? "Empty asset name" : "Empty contact";
+            log_error ("Sending of alert notification failed : %s", reason);
+            record.code = static_cast <int32_t> (SmtpError::Unknown);
+            Metrics::global ().counter ("alert_errors").add ();
+            zmsg_addstr (reply, "ERROR");
+            zmsg_addstr (reply, reason);
+        }
+        else {
+            // rendered once per language; the session shares settings and msmtp
+            // configuration, each delivery is still its own msmtp process
+            // arena is reset after each delivery, so fields are copied out of it
+            std::string priority_copy = priority, extname_copy = extname;
+            zmsg_t *statuses = zmsg_new ();
+            smtp.begin_session ();
+            size_t failed = s_fanout (smtp, *settings, render_cache, alert, priority_copy.c_str (), extname_copy.c_str (),
+                    emails, false, statuses, arena, records, uuid, trace);
+            failed += s_fanout (smtp, *settings, render_cache, alert, priority_copy.c_str (), extname_copy.c_str (),
+                    phones, true, statuses, arena, records, uuid, trace);
+            smtp.end_session ();
+            zmsg_addstrf (reply, "%zu", failed);
+            zframe_t *frame;
+            while ((frame = zmsg_pop (statuses)) != NULL)
+                zmsg_append (reply, &frame);
+            zmsg_destroy (&statuses);
+        }
+        reply_subject = "NOTIFY_ALERT";
+        fty_proto_destroy (&alert);
+    }
+    else
+        log_warning ("%s:\tUnknown subject %s", name, topic.c_str ());
+
+    if (reply_subject && topic == "SENDMAIL_ASYNC") {
+        // sender got SENDMAIL-ACCEPTED, the status is published under uuid
+        zmsg_pushstr (reply, uuid);
+        zmsg_pushstr (reply, "PUBLISH");
+        zmsg_send (&reply, pipe);
+        if (trace)
+            trace->mark (Trace::REPLY);
+    }
+    else
+    if (reply_subject && sender) {
+        zmsg_pushstr (reply, reply_subject);
+        zmsg_pushstr (reply, sender);
+        zmsg_pushstr (reply, "REPLY");
+        zmsg_send (&reply, pipe);
+        if (trace)
+            trace->mark (Trace::REPLY);
+    }
+    zmsg_destroy (&reply);
+    zmsg_destroy (&zmessage);
+    zstr_free (&uuid);
+    zstr_free (&sender);
+    if (records.size () > 1)
+        records.erase (records.begin ());
+}
+
+void
+emailworker (zsock_t *pipe, void *args)
+{
+    assert (args);
+    const EmailWorkerArgs *worker_args = static_cast <const EmailWorkerArgs*> (args);
+    char *name = strdup (worker_args->name ? worker_args->name : "fty-email-worker");
+    MailQueue *queue = worker_args->queue;
+    MemoryBudget *budget = worker_args->budget;
+    assert (queue);
+    char *test_reader_name = NULL;
+    mlm_client_t *test_client = NULL;
+    // records of deliveries are sent to the dispatcher for the producer stream
+    bool events = false;
+    std::vector <DeliveryRecord> records;
+
+    Smtp smtp;
+    RenderCache render_cache;
+    // scratch memory of one mailbox message, reset after the reply is sent
+    Arena arena;
+    smtp.arena (&arena);
+
+    static Histogram& latency_us = Metrics::global ().histogram ("latency_us");
+
+    zsock_signal (pipe, 0);
+    while (!zsys_interrupted) {
+        // mails are processed one by one, pipe is checked in between, so
+        // commands are not starved; sleep only if the queue is empty
+        zmq_pollitem_t items [] = {
+            {zsock_resolve (pipe), 0, ZMQ_POLLIN, 0},
+            {NULL, queue->fd (), ZMQ_POLLIN, 0}
+        };
+        long timeout = queue->prepare_wait () ? -1 : 0;
+        int rc = zmq_poll (items, 2, timeout);
+        if (timeout == -1)
+            queue->awake ();
+        if (rc == -1)
+            break;
+
+        size_t charge = 0;
+        Trace *trace = NULL;
+        zmsg_t *mail = queue->pop (&charge, &trace);
+        if (mail) {
+            if (trace)
+                trace->mark (Trace::QUEUE);
+            smtp.trace (trace);
+            s_mailbox (pipe, name, smtp, render_cache, arena, &mail, trace, records);
+            smtp.trace (NULL);
+            int64_t latency = 0;
+            uint32_t worker = 0;
+            if (trace) {
+                latency = trace->total ();
+                worker = static_cast <uint32_t> (trace->worker);
+                latency_us.record (latency);
+                Tracer::global ().finish (trace);
+            }
+            int64_t now = zclock_time ();
+            std::shared_ptr <const SmtpSettings> settings = smtp.settings ();
+            for (DeliveryRecord& record : records) {
+                record.latency = latency;
+                record.worker = worker;
+                record.time = now;
+                snprintf (record.relay, sizeof (record.relay), "%s:%s", settings->host.c_str (), settings->port.c_str ());
+                FlightRecorder::global ().record (record);
+                if (events)
+                    zsock_send (pipe, "sb", "EVENT", &record, sizeof (record));
+            }
+            // mail is rendered and sent, its memory is free
+            if (budget)
+                budget->release (charge);
+            log_debug ("%s:\tarena: allocations=%zu, bytes=%zu, chunks=%zu",
+                    name, arena.allocations (), arena.bytes (), arena.chunks ());
+            arena.reset ();
+        }
+
+        if (!(items [0].revents & ZMQ_POLLIN))
+            continue;
+
+        zmsg_t *msg = zmsg_recv (pipe);
+        if (!msg)
+            break;
+        char *cmd = zmsg_popstr (msg);
+        if (!cmd) {
+            zmsg_destroy (&msg);
+            continue;
+        }
+
+        if (streq (cmd, "$TERM")) {
+            zstr_free (&cmd);
+            zmsg_destroy (&msg);
+            break;
+        }
+        else
+        if (streq (cmd, "SETTINGS")) {
+            std::shared_ptr <const SmtpSettings> *settings =
+                static_cast <std::shared_ptr <const SmtpSettings>*> (s_popptr (msg));
+            if (settings) {
+                // rendered alerts are kept, the language they are rendered in is a part of their key
+                smtp.settings (*settings);
+                delete settings;
+            }
+        }
+        else
+        if (streq (cmd, "CACHESIZE")) {
+            char *size = zmsg_popstr (msg);
+            size_t capacity = RenderCache::DEFAULT_CAPACITY;
+            if (size)
+                sscanf (size, "%zu", &capacity);
+            render_cache.capacity (capacity);
+            zstr_free (&size);
+        }
+        else
+        if (streq (cmd, "EVENTS")) {
+            char *enabled = zmsg_popstr (msg);
+            events = enabled && streq (enabled, "1");
+            zstr_free (&enabled);
+        }
+        else
+        if (streq (cmd, "TEST")) {
+            char *endpoint = zmsg_popstr (msg);
+            zstr_free (&test_reader_name);
+            test_reader_name = zmsg_popstr (msg);
+            mlm_client_destroy (&test_client);
+            test_client = mlm_client_new ();
+            assert (test_client);
+            assert (endpoint);
+            // each worker needs its own client, name must be unique
+            std::string client_name = std::string ("smtp-test-client-") + name;
+            int rv = mlm_client_connect (test_client, endpoint, 1000, client_name.c_str ());
+            if (rv == -1) {
+                log_error ("%s\t:can't connect on test_client, endpoint=%s", name, endpoint);
+            }
+            std::function <void (const std::string &)> cb = \
+                [test_client, test_reader_name] (const std::string &data) {
+                    mlm_client_sendtox (test_client, test_reader_name, "btest", data.c_str (), NULL);
+                };
+            smtp.sendmail_set_test_fn (cb);
+            zstr_free (&endpoint);
+        }
+        else
+        if (streq (cmd, "RENDERCACHE")) {
+            zstr_sendx (pipe,
+                    "RENDERCACHE",
+                    std::to_string (render_cache.hits ()).c_str (),
+                    std::to_string (render_cache.misses ()).c_str (),
+                    std::to_string (render_cache.size ()).c_str (),
+                    std::to_string (render_cache.descriptions ().hits ()).c_str (),
+                    std::to_string (render_cache.descriptions ().misses ()).c_str (),
+                    NULL);
+        }
+        else
+            log_error ("%s:\tunhandled command %s", name, cmd);
+
+        zstr_free (&cmd);
+        zmsg_destroy (&msg);
+    }
+
+    mlm_client_destroy (&test_client);
+    zstr_free (&test_reader_name);
+    zstr_free (&name);
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+emailworker_test (bool verbose)
+{
+    printf (" * emailworker: ");
+
+    //  @selftest
+    MemoryBudget budget;
+    MailQueue queue {4, &budget};
+    EmailWorkerArgs args {"test-worker", &queue, &budget};
+    zactor_t *worker = zactor_new (emailworker, &args);
+    assert (worker);
+
+    // SENDMAIL is processed by worker and the reply goes back to the pipe
+    {
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, "sender");
+        zmsg_addstr (msg, "SENDMAIL");
+        zmsg_addstr (msg, "UUID");
+        zmsg_addstr (msg, "To: nobody@example.com\r\n\r\nbody");
+        size_t charge = admission_charge (msg);
+        assert (budget.try_acquire (charge));
+        Trace *trace = new Trace ("UUID", "SENDMAIL");
+        trace->mark (Trace::RECEIVE);
+        assert (queue.push (&msg, charge, trace));
+
+        // there is no smtp/server configured, so msmtp is not called
+        zmsg_t *reply = zmsg_recv (worker);
+        assert (reply);
+        char *cmd = zmsg_popstr (reply);
+        char *recipient = zmsg_popstr (reply);
+        char *subject = zmsg_popstr (reply);
+        char *uuid = zmsg_popstr (reply);
+        char *code = zmsg_popstr (reply);
+        assert (streq (cmd, "REPLY"));
+        assert (streq (recipient, "sender"));
+        assert (streq (subject, "SENDMAIL-OK"));
+        assert (streq (uuid, "UUID"));
+        assert (streq (code, "0"));
+        zstr_free (&cmd);
+        zstr_free (&recipient);
+        zstr_free (&subject);
+        zstr_free (&uuid);
+        zstr_free (&code);
+        zmsg_destroy (&reply);
+        // charge is released right after the reply is sent
+        for (int i = 0; i != 100 && budget.used () != 0; i++)
+            zclock_sleep (10);
+        assert (budget.used () == 0);
+        // trace went through the stages up to the reply
+        std::string json = Tracer::global ().to_chrome_json ();
+        assert (json.find ("\"uuid\": \"UUID\"") != std::string::npos);
+        assert (json.find ("\"name\": \"reply\"") != std::string::npos);
+    }
+
+    // contact states its language after semicolon
+    {
+        std::string contact = "joe@example.com ; cs_CZ";
+        assert (s_language (contact, "en_US") == "cs_CZ");
+        assert (contact == "joe@example.com");
+        contact = "+79 (0) 123456;";
+        assert (s_language (contact, "en_US") == "en_US");
+        assert (contact == "+79 (0) 123456");
+        contact = "jane@example.com";
+        assert (s_language (contact, "en_US") == "en_US");
+        assert (contact == "jane@example.com");
+    }
+
+    // settings are handed over as a shared snapshot
+    {
+        std::shared_ptr <SmtpSettings> settings = std::make_shared <SmtpSettings> ();
+        settings->language = "cs_CZ";
+        zsock_send (worker, "sp", "SETTINGS", new std::shared_ptr <const SmtpSettings> (settings));
+        zstr_sendx (worker, "CACHESIZE", "16", NULL);
+        zstr_sendx (worker, "RENDERCACHE", NULL);
+        char *cmd, *hits, *misses, *size, *desc_hits, *desc_misses;
+        int r = zstr_recvx (worker, &cmd, &hits, &misses, &size, &desc_hits, &desc_misses, NULL);
+        assert (r == 6);
+        assert (streq (cmd, "RENDERCACHE"));
+        assert (streq (size, "0"));
+        zstr_free (&cmd);
+        zstr_free (&hits);
+        zstr_free (&misses);
+        zstr_free (&size);
+        zstr_free (&desc_hits);
+        zstr_free (&desc_misses);
+        // worker keeps its own reference
+        assert (settings.use_count () == 2);
+    }
+
+    // decoded SENDMAIL, message is taken over by decoder
+    {
+        zmsg_t *msg = fty_email_encode ("UUID2", "nobody@example.com", "subject", NULL, "body", NULL);
+        zmsg_pushstr (msg, "SENDMAIL");
+        zmsg_pushstr (msg, "sender");
+        assert (queue.push (&msg));
+
+        char *cmd, *recipient, *subject, *uuid, *code, *reason;
+        int r = zstr_recvx (worker, &cmd, &recipient, &subject, &uuid, &code, &reason, NULL);
+        assert (r == 6);
+        assert (streq (subject, "SENDMAIL-OK"));
+        assert (streq (uuid, "UUID2"));
+        zstr_free (&cmd);
+        zstr_free (&recipient);
+        zstr_free (&subject);
+        zstr_free (&uuid);
+        zstr_free (&code);
+        zstr_free (&reason);
+    }
+
+    // status of SENDMAIL_ASYNC is published under its uuid
+    {
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, "sender");
+        zmsg_addstr (msg, "SENDMAIL_ASYNC");
+        zmsg_addstr (msg, "UUID3");
+        zmsg_addstr (msg, "To: nobody@example.com\r\n\r\nbody");
+        assert (queue.push (&msg));
+
+        char *cmd, *subject, *uuid, *code, *reason;
+        int r = zstr_recvx (worker, &cmd, &subject, &uuid, &code, &reason, NULL);
+        assert (r == 5);
+        assert (streq (cmd, "PUBLISH"));
+        assert (streq (subject, "UUID3"));
+        assert (streq (uuid, "UUID3"));
+        assert (streq (code, "0"));
+        zstr_free (&cmd);
+        zstr_free (&subject);
+        zstr_free (&uuid);
+        zstr_free (&code);
+        zstr_free (&reason);
+    }
+
+    // SENDMAIL_BATCH gets one reply with status of each email
+    {
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, "sender");
+        zmsg_addstr (msg, "SENDMAIL_BATCH");
+        zmsg_addstr (msg, "BATCH");
+        zmsg_t *email = fty_email_encode ("ITEM1", "nobody@example.com", "subject", NULL, "body", NULL);
+        assert (fty_email_batch_append (msg, &email) == 0);
+        assert (!email);
+        email = zmsg_new ();
+        zmsg_addstr (email, "ITEM2");
+        zmsg_addstr (email, "To: nobody@example.com\r\n\r\nbody");
+        assert (fty_email_batch_append (msg, &email) == 0);
+        zmsg_addstr (msg, "garbage");
+        assert (queue.push (&msg));
+
+        zmsg_t *reply = zmsg_recv (worker);
+        assert (reply);
+        assert (zmsg_size (reply) == 14);
+        const char *expected [] = {"REPLY", "sender", "SENDMAIL_BATCH", "BATCH", "1",
+            "ITEM1", "0", "OK", "ITEM2", "0", "OK", "", "10"};
+        for (const char *value : expected) {
+            char *frame = zmsg_popstr (reply);
+            assert (streq (frame, value));
+            zstr_free (&frame);
+        }
+        zmsg_destroy (&reply);
+    }
+
+    zactor_destroy (&worker);
+
+    // each item of the batch has its own delivery record, request has none
+    {
+        std::string deliveries = FlightRecorder::global ().to_string ();
+        assert (deliveries.find ("uuid=ITEM1 ") != std::string::npos);
+        assert (deliveries.find ("uuid=ITEM2 ") != std::string::npos);
+        assert (deliveries.find ("uuid=BATCH ") == std::string::npos);
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,74 @@
+/*  =========================================================================
+    emailworker - Worker actor sending emails for the fty_email_server dispatcher
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef EMAILWORKER_H_INCLUDED
+#define EMAILWORKER_H_INCLUDED
+
+//  Worker actor, which sends emails on behalf of fty_email_server
+//
+//  fty_email_server owns the malamute client and dispatches mailbox messages
+//  to workers through their MailQueue, so more emails are delivered in
+//  parallel and the mailbox is drained even when the workers are busy. Each worker has its
+//  own Smtp, render cache and arena, nothing is shared but the immutable
+//  settings snapshot.
+//
+//  Actor commands
+//  ==============
+//
+//  SETTINGS    ptr             new settings, ptr is heap allocated
+//                              std::shared_ptr <const SmtpSettings>, worker takes ownership
+//  CACHESIZE   size            capacity of the rendered alerts cache
+//  TEST        endpoint/reader deliver emails to reader over malamute instead of msmtp,
+//                              for testing purposes only
+//  RENDERCACHE                 reply RENDERCACHE/hits/misses/size/description hits/description misses
+//
+//  Actor output
+//  ============
+//
+//  REPLY       recipient/subject/...
+//                              reply to be sent to recipient over malamute,
+//                              frames after subject are the reply message
+//
+//  Mail queue
+//  ==========
+//
+//  sender/subject/uuid/...     mailbox message from sender to be processed,
+//                              frames after subject are the original message,
+//                              its charge is released from the budget when done
+//                              and latency since it was received is recorded
+//
+//  args:
+//      EmailWorkerArgs, queue must outlive the actor
+struct EmailWorkerArgs {
+    const char *name;
+    MailQueue *queue;
+    // charge of processed mails is released here, can be NULL
+    MemoryBudget *budget;
+};
+
+void
+    emailworker (zsock_t *pipe, void *args);
+
+void
+    emailworker_test (bool verbose);
+
+#endif // EMAILWORKER_H_INCLUDED
@@ -0,0 +1,254 @@
+/*  =========================================================================
+    flightrecorder - Ring of recent delivery records
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    flightrecorder - Ring of recent delivery records
+@discuss
+@end
+*/
+
+#include "fty_email_classes.h"
+
+FlightRecorder::FlightRecorder (size_t capacity):
+    _mutex {},
+    _ring (std::max <size_t> (capacity, 1)),
+    _count {0}
+{
+}
+
+FlightRecorder&
+FlightRecorder::global ()
+{
+    static FlightRecorder recorder;
+    return recorder;
+}
+
+void
+FlightRecorder::record (const DeliveryRecord& record)
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    _ring [_count % _ring.size ()] = record;
+    _count ++;
+}
+
+size_t
+FlightRecorder::size () const
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    return std::min <uint64_t> (_count, _ring.size ());
+}
+
+std::string
+FlightRecorder::to_string () const
+{
+    // records are copied out, so the workers are not blocked by formatting
+    std::vector <DeliveryRecord> records;
+    uint64_t count;
+    {
+        std::lock_guard <std::mutex> lock (_mutex);
+        records = _ring;
+        count = _count;
+    }
+
+    std::string ret;
+    uint64_t first = count > records.size () ? count - records.size () : 0;
+    for (uint64_t i = first; i != count; i++) {
+        const DeliveryRecord& r = records [i % records.size ()];
+        time_t seconds = static_cast <time_t> (r.time / 1000);
+        struct tm tm;
+        char time [32];
+        strftime (time, sizeof (time), "%Y-%m-%dT%H:%M:%S", gmtime_r (&seconds, &tm));
+        char line [384];
+        snprintf (line, sizeof (line),
+                "%s.%03dZ uuid=%s subject=%s worker=%" PRIu32 " to=%s size=%" PRIu64
+                " latency_ms=%" PRId64 ".%03d code=%" PRId32 " relay=%s\n",
+                time, static_cast <int> (r.time % 1000),
+                r.uuid, r.subject, r.worker, r.recipient, r.size,
+                r.latency / 1000, static_cast <int> (r.latency % 1000),
+                r.code, r.relay);
+        ret.append (line);
+    }
+    return ret;
+}
+
+int
+FlightRecorder::dump (const std::string& path) const
+{
+    std::string data = to_string ();
+    std::string tmp = path + ".tmp";
+    FILE *file = fopen (tmp.c_str (), "w");
+    if (!file) {
+        log_error ("can't write deliveries to %s: %s", tmp.c_str (), strerror (errno));
+        return -1;
+    }
+    size_t written = fwrite (data.data (), 1, data.size (), file);
+    if (fclose (file) != 0 || written != data.size () || rename (tmp.c_str (), path.c_str ()) == -1) {
+        log_error ("can't write deliveries to %s", path.c_str ());
+        unlink (tmp.c_str ());
+        return -1;
+    }
+    return 0;
+}
+
+DeliveryEvents::DeliveryEvents (size_t batch, int64_t interval):
+    _batch {std::max <size_t> (batch, 1)},
+    _interval {std::max <int64_t> (interval, 0)},
+    _msg {NULL},
+    _size {0},
+    _oldest {0}
+{
+}
+
+DeliveryEvents::~DeliveryEvents ()
+{
+    zmsg_destroy (&_msg);
+}
+
+void
+DeliveryEvents::add (const DeliveryRecord& record, int64_t now)
+{
+    if (!_msg) {
+        _msg = zmsg_new ();
+        _oldest = now;
+    }
+    // the agent does not retry, each delivery is attempted once
+    zmsg_addstr (_msg, record.uuid);
+    zmsg_addstr (_msg, record.recipient);
+    zmsg_addstr (_msg, record.code == 0 ? "OK" : "ERROR");
+    zmsg_addstrf (_msg, "%" PRId32, record.code);
+    zmsg_addstrf (_msg, "%" PRId64, record.latency);
+    zmsg_addstr (_msg, "1");
+    _size ++;
+}
+
+bool
+DeliveryEvents::ready (int64_t now) const
+{
+    return _size > 0 && (_size >= _batch || now - _oldest >= _interval);
+}
+
+int64_t
+DeliveryEvents::timeout (int64_t now) const
+{
+    if (_size == 0)
+        return -1;
+    return ready (now) ? 0 : _oldest + _interval - now;
+}
+
+zmsg_t*
+DeliveryEvents::take ()
+{
+    zmsg_t *ret = _msg;
+    _msg = NULL;
+    _size = 0;
+    return ret;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+flightrecorder_test (bool verbose)
+{
+    printf (" * flightrecorder: ");
+
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    //  @selftest
+    FlightRecorder recorder {2};
+    assert (recorder.size () == 0);
+    assert (recorder.to_string ().empty ());
+
+    DeliveryRecord record {};
+    record.time = 1500000000123;
+    record.latency = 12345;
+    record.size = 100;
+    record.code = 0;
+    record.worker = 1;
+    DeliveryRecord::copy (record.uuid, "UUID1");
+    DeliveryRecord::copy (record.subject, "SENDMAIL");
+    DeliveryRecord::copy (record.recipient, "joe@example.com");
+    DeliveryRecord::copy (record.relay, "mail.example.com:25");
+    recorder.record (record);
+    assert (recorder.size () == 1);
+    assert (recorder.to_string () ==
+            "2017-07-14T02:40:00.123Z uuid=UUID1 subject=SENDMAIL worker=1 to=joe@example.com"
+            " size=100 latency_ms=12.345 code=0 relay=mail.example.com:25\n");
+
+    // long strings are truncated
+    DeliveryRecord::copy (record.uuid, "UUID2");
+    DeliveryRecord::copy (record.subject, "SUBJECT-WHICH-IS-TOO-LONG");
+    assert (streq (record.subject, "SUBJECT-WHICH-I"));
+    DeliveryRecord::copy (record.recipient, NULL);
+    assert (streq (record.recipient, ""));
+    recorder.record (record);
+
+    // the oldest record is overwritten
+    DeliveryRecord::copy (record.uuid, "UUID3");
+    record.code = 4;
+    recorder.record (record);
+    assert (recorder.size () == 2);
+    std::string dumped = recorder.to_string ();
+    if (verbose)
+        log_debug ("deliveries:\n%s", dumped.c_str ());
+    assert (dumped.find ("UUID1") == std::string::npos);
+    assert (dumped.find ("uuid=UUID2") < dumped.find ("uuid=UUID3"));
+    assert (dumped.find ("code=4") != std::string::npos);
+
+    std::string path = std::string (SELFTEST_DIR_RW) + "/deliveries.txt";
+    assert (recorder.dump (path) == 0);
+    FILE *file = fopen (path.c_str (), "r");
+    assert (file);
+    char line [384];
+    assert (fgets (line, sizeof (line), file));
+    assert (strstr (line, "uuid=UUID2"));
+    fclose (file);
+    unlink (path.c_str ());
+
+    // events are published in batches of given size or age
+    DeliveryEvents events {2, 1000};
+    assert (events.timeout (0) == -1);
+    assert (!events.take ());
+    events.add (record, 100);
+    assert (!events.ready (100));
+    assert (events.timeout (600) == 500);
+    assert (events.ready (1100));
+    DeliveryRecord::copy (record.uuid, "UUID4");
+    record.code = 0;
+    events.add (record, 200);
+    assert (events.ready (200));
+    zmsg_t *batch = events.take ();
+    assert (events.size () == 0);
+    assert (zmsg_size (batch) == 2 * DeliveryEvents::FRAMES);
+    const char *expected [] = {"UUID3", "", "ERROR", "4", "12345", "1", "UUID4", "", "OK", "0"};
+    for (const char *value : expected) {
+        char *frame = zmsg_popstr (batch);
+        assert (streq (frame, value));
+        zstr_free (&frame);
+    }
+    zmsg_destroy (&batch);
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,163 @@
+/*  =========================================================================
+    flightrecorder - Ring of recent delivery records
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef FLIGHTRECORDER_H_INCLUDED
+#define FLIGHTRECORDER_H_INCLUDED
+
+#include <mutex>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * \brief compact record of one delivery
+ *
+ * Strings are truncated to fit, so filling the record needs no allocation.
+ */
+struct DeliveryRecord {
+    // wall clock time when the delivery finished, ms since epoch
+    int64_t time;
+    // time from receiving the request to the reply, us
+    int64_t latency;
+    // size of the request in bytes
+    uint64_t size;
+    // SmtpError code, 0 on success
+    int32_t code;
+    uint32_t worker;
+    char uuid [48];
+    char subject [16];
+    char recipient [64];
+    // smtp server as host:port
+    char relay [64];
+
+    /** \brief copy string to the fixed buffer, truncate it if needed */
+    template <size_t N>
+    static void copy (char (&dst) [N], const char *src)
+    {
+        if (!src)
+            src = "";
+        strncpy (dst, src, N - 1);
+        dst [N - 1] = '\0';
+    }
+};
+
+/**
+ * \class FlightRecorder
+ *
+ * \brief Fixed size ring of the last delivery records
+ *
+ * Ring is allocated once, record () copies the record into the slot of the
+ * oldest one. The ring is dumped on SIGUSR1 and by the DELIVERIES mailbox
+ * request, so what the last deliveries looked like is known after an
+ * incident without verbose logging.
+ */
+class FlightRecorder
+{
+    public:
+        static const size_t DEFAULT_CAPACITY = 512;
+
+        explicit FlightRecorder (size_t capacity = DEFAULT_CAPACITY);
+
+        FlightRecorder (const FlightRecorder&) = delete;
+        FlightRecorder& operator= (const FlightRecorder&) = delete;
+
+        /** \brief recorder of the process */
+        static FlightRecorder& global ();
+
+        /** \brief store the record, overwrites the oldest one if the ring is full */
+        void record (const DeliveryRecord& record);
+
+        /** \brief number of stored records */
+        size_t size () const;
+        size_t capacity () const { return _ring.size (); }
+
+        /** \brief stored records from the oldest, one line each */
+        std::string to_string () const;
+
+        /** \brief write to_string () to the file (atomically replaced), return 0 on success */
+        int dump (const std::string& path) const;
+
+    protected:
+        mutable std::mutex _mutex;
+        std::vector <DeliveryRecord> _ring;
+        // number of records ever stored
+        uint64_t _count;
+};
+
+/**
+ * \class DeliveryEvents
+ *
+ * \brief Batch of delivery events for the producer stream
+ *
+ * Each delivery is six frames [$uuid|$recipient|$status|$code|$latency_us|$attempts],
+ * status is OK or ERROR, code is SmtpError. Attempts is always 1, the agent
+ * has no retries; the frame keeps the format stable once it has them.
+ * Events are appended to one message, which is published when it holds
+ * batch events or when its oldest event waited interval ms, so the broker
+ * sees few messages.
+ */
+class DeliveryEvents
+{
+    public:
+        static const size_t DEFAULT_BATCH = 64;
+        static const int64_t DEFAULT_INTERVAL_MS = 1000;
+        static const size_t FRAMES = 6;
+
+        explicit DeliveryEvents (size_t batch = DEFAULT_BATCH, int64_t interval = DEFAULT_INTERVAL_MS);
+        ~DeliveryEvents ();
+
+        DeliveryEvents (const DeliveryEvents&) = delete;
+        DeliveryEvents& operator= (const DeliveryEvents&) = delete;
+
+        void batch (size_t batch) { _batch = std::max <size_t> (batch, 1); }
+        void interval (int64_t interval) { _interval = std::max <int64_t> (interval, 0); }
+
+        /** \brief append event of the delivery, now is zclock_mono () */
+        void add (const DeliveryRecord& record, int64_t now);
+
+        /** \brief true if the batch is full or its oldest event is old enough */
+        bool ready (int64_t now) const;
+
+        /** \brief ms until the batch is ready, -1 if it is empty */
+        int64_t timeout (int64_t now) const;
+
+        /** \brief take the batch over, NULL if it is empty */
+        zmsg_t* take ();
+
+        /** \brief number of events in the batch */
+        size_t size () const { return _size; }
+
+    protected:
+        size_t _batch;
+        int64_t _interval;
+        zmsg_t *_msg;
+        size_t _size;
+        // zclock_mono of the oldest event in the batch
+        int64_t _oldest;
+};
+
+void
+flightrecorder_test (bool verbose);
+
+#endif // FLIGHTRECORDER_H_INCLUDED
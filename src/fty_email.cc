@@ -27,11 +27,15 @@
 */
 
 #include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
 #include <fty_common_translation.h>
 #include "fty_email_classes.h"
 
 #define TRANSLATION_ROOT    "/usr/share/etn-translations"
 #define TRANSLATION_PREFIX  "locale_"
+#define DEFAULT_DELIVERIES_FILE "/var/lib/fty/fty-email/deliveries.txt"
 
 // hack to allow reload of config file w/o the need to rewrite server to zloop and reactors
 char *config_file = NULL;
@@ -57,22 +61,76 @@ void usage ()
 }
 
 
+// actors to be notified about config changes
+struct ConfigReload {
+    ConfigWatch *watch;
+    std::vector <zactor_t*> actors;
+};
+
+// reload the config and send LOAD to all server actors
+static void
+s_reload (ConfigReload *reload)
+{
+    log_info ("Content of %s have changed, reload it", config_file);
+    zconfig_reload (&config);
+    for (zactor_t *actor : reload->actors)
+        zstr_sendx (actor, "LOAD", config_file, NULL);
+}
+
+static int
+s_config_event (zloop_t *loop, zmq_pollitem_t *item, void *args)
+{
+    ConfigReload *reload = static_cast <ConfigReload*> (args);
+    if (reload->watch->changed ())
+        s_reload (reload);
+    return 0;
+}
+
+// fallback when inotify is not available
+static int
+s_timer_event (zloop_t *loop, int timer_id, void *args)
+{
+    if (zconfig_has_changed (config))
+        s_reload (static_cast <ConfigReload*> (args));
+    return 0;
+}
+
+// SIGUSR1 dumps the flight recorder
 static int
-s_timer_event (zloop_t *loop, int timer_id, void *output)
+s_signal_event (zloop_t *loop, zmq_pollitem_t *item, void *args)
 {
-    if (zconfig_has_changed (config)) {
-        log_info ("Content of %s have changed, reload it", config_file);
-        zconfig_reload (&config);
-        zstr_sendx (output, "LOAD", config_file, NULL);
+    struct signalfd_siginfo info;
+    while (read (item->fd, &info, sizeof (info)) == sizeof (info)) {
+        const char *path = zconfig_get (config, "server/deliveries_file", DEFAULT_DELIVERIES_FILE);
+        if (FlightRecorder::global ().dump (path) == 0)
+            log_info ("%zu deliveries written to %s", FlightRecorder::global ().size (), path);
     }
     return 0;
 }
 
+// children (msmtp) inherit the signal mask of the forking thread, but they
+// don't read the signalfd, so SIGUSR1 is unblocked for them before exec
+static void
+s_unblock_sigusr1 (void)
+{
+    sigset_t sigusr1;
+    sigemptyset (&sigusr1);
+    sigaddset (&sigusr1, SIGUSR1);
+    sigprocmask (SIG_UNBLOCK, &sigusr1, NULL);
+}
+
 int main (int argc, char** argv)
 {
     int verbose = 0;
     int help = 0;
 
+    // SIGUSR1 is received by signalfd, it must be blocked before any thread is started
+    sigset_t sigusr1;
+    sigemptyset (&sigusr1);
+    sigaddset (&sigusr1, SIGUSR1);
+    pthread_sigmask (SIG_BLOCK, &sigusr1, NULL);
+    pthread_atfork (NULL, NULL, s_unblock_sigusr1);
+
     char *smtpserver   = getenv("BIOS_SMTP_SERVER");
     char *smtpport     = getenv("BIOS_SMTP_PORT");
     char *smtpuser     = getenv("BIOS_SMTP_USER");
@@ -193,8 +251,7 @@ int main (int argc, char** argv)
         }
         else {
             language = zconfig_get (config, "server/language", DEFAULT_LANGUAGE);
-            int rv = translation_change_language (language);
-            if (rv != TE_OK)
+            if (!change_translation_language (language))
                 log_warning ("Language not changed to %s, continuing in %s", language, DEFAULT_LANGUAGE);
         }
     }
@@ -224,12 +281,30 @@ int main (int argc, char** argv)
     zstr_sendx (smtp_server, "LOAD", config_file, NULL);
     zstr_sendx (send_mail_only_server, "LOAD", config_file, NULL);
 
+    // reload is event driven, there are no wakeups while config does not change
+    ConfigWatch watch {config_file};
+    ConfigReload reload {&watch, {smtp_server, send_mail_only_server}};
     zloop_t *check_config = zloop_new();
-    // as 5 minutes is the smallest possible reaction time
-    zloop_timer (check_config, 1000, 0, s_timer_event, smtp_server);
+    if (watch.fd () != -1) {
+        zmq_pollitem_t item = {NULL, watch.fd (), ZMQ_POLLIN, 0};
+        zloop_poller (check_config, &item, s_config_event, &reload);
+    }
+    else {
+        log_warning ("Can't watch %s, falling back to periodic check", config_file);
+        zloop_timer (check_config, 1000, 0, s_timer_event, &reload);
+    }
+    int signal_fd = signalfd (-1, &sigusr1, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd != -1) {
+        zmq_pollitem_t item = {NULL, signal_fd, ZMQ_POLLIN, 0};
+        zloop_poller (check_config, &item, s_signal_event, NULL);
+    }
+    else
+        log_warning ("Can't receive SIGUSR1: %s", strerror (errno));
     zloop_start (check_config);
 
     zloop_destroy (&check_config);
+    if (signal_fd != -1)
+        close (signal_fd);
     zactor_destroy (&smtp_server);
     zactor_destroy (&send_mail_only_server);
     zstr_free (&translation_path);
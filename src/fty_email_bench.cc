@@ -0,0 +1,684 @@
+/*  =========================================================================
+    fty_email_bench - Throughput and latency benchmark of fty-email
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    fty_email_bench - Throughput and latency benchmark of fty-email
+@discuss
+
+    Usage:
+    fty-email-bench -n 10000 -c 64 -a 50 -l 20 -f 1
+
+    Starts inproc Malamute broker and fty_email_server actor in the process,
+    msmtp is replaced by a stub (this binary run with --msmtp), which reads
+    the mail, sleeps for given latency and fails with given probability.
+    Requests are sent at given rate with given number of outstanding
+    requests, throughput and latency percentiles are printed at the end.
+
+    fty-email-bench --replay fty-email.cap --speed 10 -l 20
+
+    Replays requests captured by the agent (see server/capture_dir) with
+    their original timing, 10 times faster. Speed 0 sends them as fast as
+    the concurrency allows. Missing attachments, of SENDMAIL_BATCH items
+    too, are replaced by files of the captured size.
+
+    fty-email-bench -n 5000000 -a 50 -c 64 -w 4 --soak 60 --reload 10000
+
+    Soak run: the configuration is reloaded every 10000 requests, RSS, open
+    file descriptors, entries in /tmp and heap in use are sampled every 60 s.
+    The first sample is the baseline, the final one is taken once all replies
+    came. The run fails when memory grew more than --growth percent or when
+    there are more descriptors or /tmp entries than at the baseline.
+
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <getopt.h>
+#include <malloc.h>
+#include <dirent.h>
+#include <fty_common_translation.h>
+#include <map>
+#include <climits>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+
+#define BENCH_ENDPOINT  "inproc://fty-email-bench"
+#define BENCH_ADDRESS   "fty-email-bench-agent"
+#define LATENCY_SAMPLES 100000
+
+// parameters of the stub are passed to msmtp child through environment
+#define ENV_LATENCY     "FTY_EMAIL_BENCH_LATENCY"
+#define ENV_FAILURE     "FTY_EMAIL_BENCH_FAILURE"
+
+void usage ()
+{
+    puts ("fty-email-bench [options]\n"
+          "  -n|--requests         number of requests [1000]\n"
+          "  -c|--concurrency      max number of outstanding requests [16, unlimited for replay]\n"
+          "  -r|--rate             requests per second, 0 means as fast as possible [0]\n"
+          "  -a|--alerts           percentage of SENDMAIL_ALERT requests [0]\n"
+          "  -s|--size             size of the email body in bytes [1024]\n"
+          "  -R|--recipients       number of distinct recipients (assets for alerts) [100]\n"
+          "  -l|--latency          latency of msmtp stub in milliseconds [0]\n"
+          "  -f|--failures         percentage of failed msmtp deliveries [0]\n"
+          "  -w|--workers          number of workers of the server [1]\n"
+          "  -q|--queue-size       queue size of each worker [1024]\n"
+          "  -t|--translations     directory with test_*.json translations [src/selftest-ro]\n"
+          "  -p|--replay FILE      replay requests from the capture file instead of generating them\n"
+          "  -x|--speed X          replay speed, 1 is the captured timing, 0 as fast as possible [1]\n"
+          "  -S|--soak SECONDS     soak run, resources are sampled every SECONDS and checked at the end\n"
+          "  -L|--reload N         reload the configuration every N requests [0 = never]\n"
+          "  -g|--growth PERCENT   allowed growth of RSS and heap in soak run [10]\n"
+          "  -v|--verbose          verbose output, print server metrics at the end\n"
+          "  -h|--help             print this information\n"
+          "  --msmtp               behave as msmtp stub, used internally");
+}
+
+// msmtp stub: swallow the mail, wait and succeed or fail like msmtp does
+static int
+s_msmtp_stub ()
+{
+    char buffer [65536];
+    while (read (STDIN_FILENO, buffer, sizeof (buffer)) > 0)
+        ;
+
+    const char *latency = getenv (ENV_LATENCY);
+    const char *failure = getenv (ENV_FAILURE);
+    if (latency && atof (latency) > 0)
+        usleep (static_cast <useconds_t> (atof (latency) * 1000));
+
+    std::mt19937 random (static_cast <unsigned> (getpid () ^ zclock_usecs ()));
+    if (failure && std::uniform_real_distribution <double> (0, 100) (random) < atof (failure)) {
+        fprintf (stderr, "msmtp: recipient address not accepted by the server\n"
+                "msmtp: server message: 550 5.1.1 mailbox unavailable\n");
+        // EX_UNAVAILABLE
+        return 69;
+    }
+    return 0;
+}
+
+// wrapper script, which runs this binary as the msmtp stub
+static std::string
+s_write_stub (const std::string& dir)
+{
+    char self [PATH_MAX + 1];
+    ssize_t r = readlink ("/proc/self/exe", self, PATH_MAX);
+    if (r == -1) {
+        log_error ("Can't resolve /proc/self/exe: %s", strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    self [r] = '\0';
+
+    std::string path = dir + "/msmtp";
+    FILE *file = fopen (path.c_str (), "w");
+    if (!file) {
+        log_error ("Can't write %s: %s", path.c_str (), strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    fprintf (file, "#!/bin/sh\nexec '%s' --msmtp \"$@\"\n", self);
+    fclose (file);
+    chmod (path.c_str (), 0700);
+    return path;
+}
+
+static zmsg_t*
+s_sendmail (const char *uuid, int recipient, const std::string& body)
+{
+    char to [64];
+    snprintf (to, sizeof (to), "user%d@example.com", recipient);
+    return fty_email_encode (uuid, to, "fty-email-bench", NULL, body.c_str (), NULL);
+}
+
+static zmsg_t*
+s_alert (const char *uuid, int asset)
+{
+    char name [32];
+    snprintf (name, sizeof (name), "asset-%d", asset);
+    zlist_t *actions = zlist_new ();
+    zlist_append (actions, (void *) "EMAIL");
+    std::string description = std::string ("{ \"key\": \"Device {{var1}} does not provide expected data. "
+            "It may be offline or not correctly configured.\", \"variables\": { \"var1\": \"") + name + "\" } }";
+    zmsg_t *msg = fty_proto_encode_alert (NULL, zclock_time () / 1000, 600, "bench-rule", name,
+            "ACTIVE", "CRITICAL", description.c_str (), actions);
+    zlist_destroy (&actions);
+    zmsg_pushstr (msg, "bench@example.com");
+    zmsg_pushstr (msg, name);
+    zmsg_pushstr (msg, "1");
+    zmsg_pushstr (msg, uuid);
+    return msg;
+}
+
+// file of given size, which replaces a missing attachment of a captured request
+static std::string
+s_attachment (const std::string& dir, uint64_t size, std::map <uint64_t, std::string>& files)
+{
+    auto it = files.find (size);
+    if (it != files.end ())
+        return it->second;
+    std::string path = dir + "/attachment-" + std::to_string (size) + ".txt";
+    FILE *file = fopen (path.c_str (), "w");
+    if (file) {
+        for (uint64_t i = 0; i != size; i++)
+            fputc (i % 73 == 72 ? '\n' : 'a' + static_cast <int> (i % 26), file);
+        fclose (file);
+    }
+    files [size] = path;
+    return path;
+}
+
+// frame of given index, NULL if there is none
+static zframe_t*
+s_frame (zmsg_t *msg, size_t index)
+{
+    zframe_t *frame = zmsg_first (msg);
+    for (size_t i = 0; i != index && frame; i++)
+        frame = zmsg_next (msg);
+    return frame;
+}
+
+// replace missing attachments (index of path frame, captured size) of msg
+static void
+s_replace_attachments (
+        zmsg_t *msg,
+        const std::vector <std::pair <size_t, uint64_t>>& attachments,
+        const std::string& dir,
+        std::map <uint64_t, std::string>& files)
+{
+    for (const auto& attachment : attachments) {
+        zframe_t *frame = s_frame (msg, attachment.first);
+        if (!frame)
+            continue;
+        std::string path ((const char*) zframe_data (frame), zframe_size (frame));
+        if (access (path.c_str (), R_OK) == 0)
+            continue;
+        path = s_attachment (dir, attachment.second, files);
+        zframe_reset (frame, path.c_str (), path.size ());
+    }
+}
+
+// prepare captured request for replay, uuid is replaced, so replies can be matched
+static zmsg_t*
+s_replayed (CaptureRecord& record, const char *uuid, const std::string& dir, std::map <uint64_t, std::string>& files)
+{
+    zmsg_t *msg = record.msg;
+    record.msg = NULL;
+    zframe_t *frame = zmsg_first (msg);
+    if (frame)
+        zframe_reset (frame, uuid, strlen (uuid));
+    s_replace_attachments (msg, record.attachments, dir, files);
+    // items of SENDMAIL_BATCH are decoded, fixed and encoded again
+    for (const auto& item : record.items) {
+        frame = s_frame (msg, item.first);
+        zmsg_t *decoded = frame ? zmsg_decode (zframe_data (frame), zframe_size (frame)) : NULL;
+        if (!decoded)
+            continue;
+        s_replace_attachments (decoded, item.second, dir, files);
+        byte *buffer = NULL;
+        size_t size = zmsg_encode (decoded, &buffer);
+        if (buffer)
+            zframe_reset (frame, buffer, size);
+        free (buffer);
+        zmsg_destroy (&decoded);
+    }
+    return msg;
+}
+
+// resources of the process, which must not grow during soak run
+struct ResourceSample {
+    double time;
+    size_t rss;
+    size_t heap;
+    int fds;
+    int tmp;
+    int sent;
+};
+
+static int
+s_count_entries (const char *path)
+{
+    DIR *dir = opendir (path);
+    if (!dir)
+        return -1;
+    int count = 0;
+    while (struct dirent *entry = readdir (dir)) {
+        if (!streq (entry->d_name, ".") && !streq (entry->d_name, ".."))
+            count ++;
+    }
+    closedir (dir);
+    return count;
+}
+
+static ResourceSample
+s_sample (int64_t start, int sent)
+{
+    ResourceSample sample {(zclock_usecs () - start) / 1000000.0, 0, 0, 0, 0, sent};
+    FILE *status = fopen ("/proc/self/status", "r");
+    if (status) {
+        char line [256];
+        while (fgets (line, sizeof (line), status)) {
+            if (sscanf (line, "VmRSS: %zu kB", &sample.rss) == 1) {
+                sample.rss *= 1024;
+                break;
+            }
+        }
+        fclose (status);
+    }
+#if defined (__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    sample.heap = mallinfo2 ().uordblks;
+#elif defined (__GLIBC__)
+    sample.heap = static_cast <unsigned> (mallinfo ().uordblks);
+#endif
+    // opendir itself holds one descriptor
+    sample.fds = s_count_entries ("/proc/self/fd") - 1;
+    sample.tmp = s_count_entries ("/tmp");
+    return sample;
+}
+
+static void
+s_print_sample (const ResourceSample& sample)
+{
+    printf ("soak: %9.1f s %10d sent, rss %8zu kB, heap %8zu kB, %4d fds, %4d /tmp entries\n",
+            sample.time, sample.sent, sample.rss / 1024, sample.heap / 1024, sample.fds, sample.tmp);
+    fflush (stdout);
+}
+
+// returns true if final sample did not grow over the baseline
+static bool
+s_check_growth (const ResourceSample& baseline, const ResourceSample& last, double growth)
+{
+    bool ret = true;
+    if (last.rss > baseline.rss * (1 + growth / 100)) {
+        printf ("soak: FAILED, RSS grew from %zu kB to %zu kB\n", baseline.rss / 1024, last.rss / 1024);
+        ret = false;
+    }
+    if (last.heap > baseline.heap * (1 + growth / 100)) {
+        printf ("soak: FAILED, heap grew from %zu kB to %zu kB\n", baseline.heap / 1024, last.heap / 1024);
+        ret = false;
+    }
+    if (last.fds > baseline.fds) {
+        printf ("soak: FAILED, open descriptors grew from %d to %d\n", baseline.fds, last.fds);
+        ret = false;
+    }
+    if (last.tmp > baseline.tmp) {
+        printf ("soak: FAILED, /tmp entries grew from %d to %d\n", baseline.tmp, last.tmp);
+        ret = false;
+    }
+    return ret;
+}
+
+static int64_t
+s_percentile (const std::vector <int64_t>& sorted, double p)
+{
+    if (sorted.empty ())
+        return 0;
+    size_t idx = static_cast <size_t> (p / 100.0 * (sorted.size () - 1) + 0.5);
+    return sorted [std::min (idx, sorted.size () - 1)];
+}
+
+int main (int argc, char** argv)
+{
+    if (argc > 1 && streq (argv [1], "--msmtp"))
+        return s_msmtp_stub ();
+
+    int help = 0;
+    int verbose = 0;
+    int requests = 1000;
+    int concurrency = 0;
+    double rate = 0;
+    int alerts = 0;
+    int size = 1024;
+    int recipients = 100;
+    const char *latency = "0";
+    const char *failures = "0";
+    const char *workers = "1";
+    const char *queue_size = "1024";
+    const char *translations = "src/selftest-ro";
+    const char *replay = NULL;
+    double speed = 1;
+    int soak = 0;
+    int reload = 0;
+    double growth = 10;
+    ManageFtyLog::setInstanceFtylog ("fty-email-bench");
+
+    // get options
+    int c;
+// Some systems define struct option with non-"const" "char *"
+#if defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wwrite-strings"
+#endif
+    static const char *short_options = "hvn:c:r:a:s:R:l:f:w:q:t:p:x:S:L:g:";
+    static struct option long_options[] =
+    {
+        {"help",         no_argument,       &help,    1},
+        {"verbose",      no_argument,       &verbose, 1},
+        {"requests",     required_argument, 0,'n'},
+        {"concurrency",  required_argument, 0,'c'},
+        {"rate",         required_argument, 0,'r'},
+        {"alerts",       required_argument, 0,'a'},
+        {"size",         required_argument, 0,'s'},
+        {"recipients",   required_argument, 0,'R'},
+        {"latency",      required_argument, 0,'l'},
+        {"failures",     required_argument, 0,'f'},
+        {"workers",      required_argument, 0,'w'},
+        {"queue-size",   required_argument, 0,'q'},
+        {"translations", required_argument, 0,'t'},
+        {"replay",       required_argument, 0,'p'},
+        {"speed",        required_argument, 0,'x'},
+        {"soak",         required_argument, 0,'S'},
+        {"reload",       required_argument, 0,'L'},
+        {"growth",       required_argument, 0,'g'},
+        {NULL, 0, 0, 0}
+    };
+#if defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic pop
+#endif
+
+    while(true) {
+
+        int option_index = 0;
+        c = getopt_long (argc, argv, short_options, long_options, &option_index);
+        if (c == -1) break;
+        switch (c) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            requests = atoi (optarg);
+            break;
+        case 'c':
+            concurrency = std::max (atoi (optarg), 1);
+            break;
+        case 'r':
+            rate = atof (optarg);
+            break;
+        case 'a':
+            alerts = atoi (optarg);
+            break;
+        case 's':
+            size = std::max (atoi (optarg), 0);
+            break;
+        case 'R':
+            recipients = std::max (atoi (optarg), 1);
+            break;
+        case 'l':
+            latency = optarg;
+            break;
+        case 'f':
+            failures = optarg;
+            break;
+        case 'w':
+            workers = optarg;
+            break;
+        case 'q':
+            queue_size = optarg;
+            break;
+        case 't':
+            translations = optarg;
+            break;
+        case 'p':
+            replay = optarg;
+            break;
+        case 'x':
+            speed = std::max (atof (optarg), 0.0);
+            break;
+        case 'S':
+            soak = std::max (atoi (optarg), 1);
+            break;
+        case 'L':
+            reload = std::max (atoi (optarg), 0);
+            break;
+        case 'g':
+            growth = std::max (atof (optarg), 0.0);
+            break;
+        case 0:
+            // just now walking trough some long opt
+            break;
+        case 'h':
+        default:
+            help = 1;
+            break;
+        }
+    }
+    if (help) { usage(); exit(1); }
+    // end of the options
+
+    // replay keeps the captured timing, so the number of outstanding requests
+    // is not limited unless asked for
+    if (concurrency == 0)
+        concurrency = replay && speed > 0 ? INT_MAX : 16;
+    CaptureReader reader;
+    CaptureRecord record;
+    if (replay && reader.open (replay) == -1)
+        exit (EXIT_FAILURE);
+
+    if (verbose)
+        ManageFtyLog::getInstanceFtylog()->setVeboseMode();
+    if (translation_initialize (FTY_EMAIL_ADDRESS, translations, "test_") != TE_OK)
+        log_warning ("Translation not initialized from %s, alerts may fail", translations);
+
+    char dir [] = "/tmp/fty-email-bench-XXXXXX";
+    if (!mkdtemp (dir)) {
+        log_error ("Can't create temporary directory: %s", strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    std::string msmtp = s_write_stub (dir);
+    setenv (ENV_LATENCY, latency, 1);
+    setenv (ENV_FAILURE, failures, 1);
+
+    zactor_t *broker = zactor_new (mlm_server, (void*) "Malamute");
+    zstr_sendx (broker, "BIND", BENCH_ENDPOINT, NULL);
+
+    std::string config_file = std::string (dir) + "/fty-email.cfg";
+    std::string spool_dir = std::string (dir) + "/spool";
+    zconfig_t *config = zconfig_new ("root", NULL);
+    zconfig_put (config, "server/workers", workers);
+    zconfig_put (config, "server/queue_size", queue_size);
+    zconfig_put (config, "server/spool_dir", spool_dir.c_str ());
+    zconfig_put (config, "smtp/server", "localhost");
+    zconfig_put (config, "smtp/gwtemplate", "0#####@hyper.mobile");
+    zconfig_put (config, "smtp/msmtppath", msmtp.c_str ());
+    zconfig_put (config, "malamute/endpoint", BENCH_ENDPOINT);
+    zconfig_put (config, "malamute/address", BENCH_ADDRESS);
+    zconfig_save (config, config_file.c_str ());
+    zconfig_destroy (&config);
+
+    zactor_t *server = zactor_new (fty_email_server, NULL);
+    zstr_sendx (server, "LOAD", config_file.c_str (), NULL);
+
+    mlm_client_t *client = mlm_client_new ();
+    int r = mlm_client_connect (client, BENCH_ENDPOINT, 1000, "fty-email-bench");
+    assert (r != -1);
+    zpoller_t *poller = zpoller_new (mlm_client_msgpipe (client), NULL);
+
+    // server connects to the broker asynchronously, give it a moment
+    zclock_sleep (500);
+
+    std::string body (size, 'x');
+    std::mt19937 random (42);
+    std::uniform_int_distribution <int> percent (0, 99);
+    std::uniform_int_distribution <int> recipient (0, recipients - 1);
+
+    std::unordered_map <std::string, int64_t> outstanding;
+    // latencies are a uniform sample of fixed size, allocated (and touched) up front,
+    // so long runs don't grow the bench itself; the sample may miss the worst
+    // reply, so the max is tracked over all replies
+    std::vector <int64_t> latencies (LATENCY_SAMPLES);
+    int64_t latency_max = 0;
+    std::map <uint64_t, std::string> attachments;
+    int sent = 0, replied = 0, ok = 0, errors = 0, busy = 0, lost = 0;
+
+    int64_t start = zclock_usecs ();
+    int64_t next_send = start;
+    int64_t last_reply = start;
+    std::vector <ResourceSample> samples;
+    int64_t next_sample = start + soak * 1000000LL;
+    bool more = replay ? reader.next (record) : requests > 0;
+    int64_t first_captured = record.time;
+    while (!zsys_interrupted && (more || !outstanding.empty ())) {
+        int64_t now = zclock_usecs ();
+        while (more && static_cast <int> (outstanding.size ()) < concurrency && now >= next_send) {
+            char uuid [32];
+            snprintf (uuid, sizeof (uuid), "bench-%08d", sent);
+            std::string subject;
+            zmsg_t *msg;
+            if (replay) {
+                subject = record.subject;
+                msg = s_replayed (record, uuid, dir, attachments);
+            }
+            else {
+                bool alert = percent (random) < alerts;
+                subject = alert ? "SENDMAIL_ALERT" : "SENDMAIL";
+                msg = alert ? s_alert (uuid, recipient (random)) : s_sendmail (uuid, recipient (random), body);
+            }
+            outstanding [uuid] = zclock_usecs ();
+            r = mlm_client_sendto (client, BENCH_ADDRESS, subject.c_str (), NULL, 1000, &msg);
+            if (r == -1) {
+                log_error ("Can't send request %s", uuid);
+                zmsg_destroy (&msg);
+                outstanding.erase (uuid);
+            }
+            sent ++;
+            if (reload > 0 && sent % reload == 0)
+                zstr_sendx (server, "LOAD", config_file.c_str (), NULL);
+
+            if (replay) {
+                more = reader.next (record);
+                if (more && speed > 0)
+                    next_send = start + static_cast <int64_t> ((record.time - first_captured) / speed);
+            }
+            else {
+                more = sent < requests;
+                if (rate > 0)
+                    next_send += static_cast <int64_t> (1000000.0 / rate);
+            }
+            now = zclock_usecs ();
+        }
+
+        if (soak && now >= next_sample) {
+            samples.push_back (s_sample (start, sent));
+            s_print_sample (samples.back ());
+            next_sample += soak * 1000000LL;
+        }
+
+        int timeout = 1000;
+        if (more && static_cast <int> (outstanding.size ()) < concurrency)
+            timeout = static_cast <int> (std::max <int64_t> (0, (next_send - now) / 1000));
+        if (soak)
+            timeout = static_cast <int> (std::min <int64_t> (timeout, std::max <int64_t> (0, (next_sample - now) / 1000)));
+        if (!zpoller_wait (poller, timeout)) {
+            if (zpoller_terminated (poller))
+                break;
+            // replies of lost requests never come
+            if (zclock_usecs () - last_reply > 30 * 1000000) {
+                lost = static_cast <int> (outstanding.size ());
+                log_error ("No reply for 30 s, %d requests lost", lost);
+                break;
+            }
+            continue;
+        }
+
+        zmsg_t *reply = mlm_client_recv (client);
+        if (!reply)
+            break;
+        last_reply = zclock_usecs ();
+        const char *subject = mlm_client_subject (client);
+        char *uuid = zmsg_popstr (reply);
+        char *status = zmsg_popstr (reply);
+        auto it = uuid ? outstanding.find (uuid) : outstanding.end ();
+        if (it != outstanding.end ()) {
+            latency_max = std::max (latency_max, last_reply - it->second);
+            int idx = replied ++;
+            if (idx >= LATENCY_SAMPLES)
+                idx = std::uniform_int_distribution <int> (0, idx) (random);
+            if (idx < LATENCY_SAMPLES)
+                latencies [idx] = last_reply - it->second;
+            outstanding.erase (it);
+            if (streq (subject, "SENDMAIL-BUSY") || (status && streq (status, "BUSY")))
+                busy ++;
+            else
+            if (streq (subject, "SENDMAIL-OK") || (status && streq (status, "OK")))
+                ok ++;
+            else
+                errors ++;
+        }
+        else
+            log_warning ("Unexpected reply %s, uuid=%s", subject, uuid ? uuid : "");
+        zstr_free (&uuid);
+        zstr_free (&status);
+        zmsg_destroy (&reply);
+    }
+    double elapsed = (zclock_usecs () - start) / 1000000.0;
+
+    latencies.resize (std::min (replied, LATENCY_SAMPLES));
+    std::sort (latencies.begin (), latencies.end ());
+    printf ("requests:    %d sent, %d ok, %d errors, %d busy, %d lost\n", sent, ok, errors, busy, lost);
+    printf ("elapsed:     %.3f s\n", elapsed);
+    printf ("throughput:  %.1f requests/s\n", elapsed > 0 ? replied / elapsed : 0);
+    printf ("latency ms:  p50 %.3f, p99 %.3f, p999 %.3f, max %.3f\n",
+            s_percentile (latencies, 50) / 1000.0,
+            s_percentile (latencies, 99) / 1000.0,
+            s_percentile (latencies, 99.9) / 1000.0,
+            latency_max / 1000.0);
+
+    // workers are idle once all replies came, so nothing in flight holds descriptors or temporary files
+    bool soak_ok = true;
+    if (soak) {
+        zclock_sleep (100);
+        samples.push_back (s_sample (start, sent));
+        s_print_sample (samples.back ());
+        if (samples.size () < 2)
+            log_warning ("Soak run shorter than the sampling interval, baseline is the final sample");
+        soak_ok = s_check_growth (samples.front (), samples.back (), growth);
+        if (soak_ok)
+            printf ("soak: OK, %zu samples\n", samples.size ());
+    }
+
+    if (verbose) {
+        r = mlm_client_sendtox (client, BENCH_ADDRESS, "STATS", "bench-stats", NULL);
+        zmsg_t *reply = r == -1 || !zpoller_wait (poller, 5000) ? NULL : mlm_client_recv (client);
+        if (reply) {
+            zframe_t *uuid = zmsg_pop (reply);
+            zframe_destroy (&uuid);
+            char *json = zmsg_popstr (reply);
+            printf ("server metrics: %s\n", json ? json : "");
+            zstr_free (&json);
+        }
+        zmsg_destroy (&reply);
+    }
+
+    zpoller_destroy (&poller);
+    mlm_client_destroy (&client);
+    zactor_destroy (&server);
+    zactor_destroy (&broker);
+    zsys_dir_delete ("%s/%s", spool_dir.c_str (), BENCH_ADDRESS);
+    zsys_dir_delete ("%s", spool_dir.c_str ());
+    unlink (config_file.c_str ());
+    unlink (msmtp.c_str ());
+    for (const auto& attachment : attachments)
+        unlink (attachment.second.c_str ());
+    rmdir (dir);
+    return lost || outstanding.size () || !soak_ok ? EXIT_FAILURE : EXIT_SUCCESS;
+}
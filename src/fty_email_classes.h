@@ -35,6 +35,10 @@
 //  Extra headers
 
 //  Opaque class structures to allow forward references
+#ifndef ARENA_T_DEFINED
+typedef struct _arena_t arena_t;
+#define ARENA_T_DEFINED
+#endif
 #ifndef EMAILCONFIGURATION_T_DEFINED
 typedef struct _emailconfiguration_t emailconfiguration_t;
 #define EMAILCONFIGURATION_T_DEFINED
@@ -43,15 +47,71 @@ typedef struct _emailconfiguration_t emailconfiguration_t;
 typedef struct _email_t email_t;
 #define EMAIL_T_DEFINED
 #endif
+#ifndef RENDERCACHE_T_DEFINED
+typedef struct _rendercache_t rendercache_t;
+#define RENDERCACHE_T_DEFINED
+#endif
+#ifndef CONFIGWATCH_T_DEFINED
+typedef struct _configwatch_t configwatch_t;
+#define CONFIGWATCH_T_DEFINED
+#endif
+#ifndef HASHRING_T_DEFINED
+typedef struct _hashring_t hashring_t;
+#define HASHRING_T_DEFINED
+#endif
+#ifndef METRICS_T_DEFINED
+typedef struct _metrics_t metrics_t;
+#define METRICS_T_DEFINED
+#endif
+#ifndef TRACE_T_DEFINED
+typedef struct _trace_t trace_t;
+#define TRACE_T_DEFINED
+#endif
+#ifndef FLIGHTRECORDER_T_DEFINED
+typedef struct _flightrecorder_t flightrecorder_t;
+#define FLIGHTRECORDER_T_DEFINED
+#endif
+#ifndef ADMISSION_T_DEFINED
+typedef struct _admission_t admission_t;
+#define ADMISSION_T_DEFINED
+#endif
+#ifndef MAILQUEUE_T_DEFINED
+typedef struct _mailqueue_t mailqueue_t;
+#define MAILQUEUE_T_DEFINED
+#endif
+#ifndef EMAILWORKER_T_DEFINED
+typedef struct _emailworker_t emailworker_t;
+#define EMAILWORKER_T_DEFINED
+#endif
+#ifndef CAPTURE_T_DEFINED
+typedef struct _capture_t capture_t;
+#define CAPTURE_T_DEFINED
+#endif
 
 //  Internal API
 
+#include "arena.h"
 #include "emailconfiguration.h"
 #include "email.h"
+#include "rendercache.h"
+#include "configwatch.h"
+#include "hashring.h"
+#include "metrics.h"
+#include "trace.h"
+#include "flightrecorder.h"
+#include "admission.h"
+#include "mailqueue.h"
+#include "emailworker.h"
+#include "capture.h"
 
 //  *** To avoid double-definitions, only define if building without draft ***
 #ifndef FTY_EMAIL_BUILD_DRAFT_API
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    arena_test (bool verbose);
+
 //  *** Draft method, defined for internal use only ***
 //  Self test of this class.
 FTY_EMAIL_PRIVATE void
@@ -62,6 +122,56 @@ FTY_EMAIL_PRIVATE void
 FTY_EMAIL_PRIVATE void
     email_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    rendercache_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    configwatch_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    hashring_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    metrics_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    trace_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    flightrecorder_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    admission_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    mailqueue_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    emailworker_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_EMAIL_PRIVATE void
+    capture_test (bool verbose);
+
 //  Self test for private classes
 FTY_EMAIL_PRIVATE void
     fty_email_private_selftest (bool verbose, const char *subtest);
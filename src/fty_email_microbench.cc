@@ -0,0 +1,422 @@
+/*  =========================================================================
+    fty_email_microbench - Microbenchmarks of rendering and encoding primitives
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    fty_email_microbench - Microbenchmarks of rendering and encoding primitives
+@discuss
+
+    Usage:
+    fty-email-microbench                                run and print results
+    fty-email-microbench --save perf/fty-email-microbench.baseline
+    fty-email-microbench --compare perf/fty-email-microbench.baseline
+
+    Each benchmark runs until it takes at least --time ms, results are
+    ns/op, bytes/op and allocations/op. Allocations are counted by
+    replaced operator new, so memory taken by malloc directly (czmq) is
+    not included. Compare mode fails if ns/op is worse than the baseline
+    by more than --threshold percent, or if allocations/op grew. It also
+    fails when the baseline is missing or has no results.
+
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <getopt.h>
+#include <fty_common_translation.h>
+
+// ----------------------------------------------------------------------------
+// allocation counting
+
+static std::atomic <uint64_t> s_allocations {0};
+static std::atomic <uint64_t> s_bytes {0};
+
+static void*
+s_allocate (size_t size)
+{
+    s_allocations.fetch_add (1, std::memory_order_relaxed);
+    s_bytes.fetch_add (size, std::memory_order_relaxed);
+    void *ret = malloc (size ? size : 1);
+    if (!ret)
+        throw std::bad_alloc ();
+    return ret;
+}
+
+void* operator new (size_t size) { return s_allocate (size); }
+void* operator new[] (size_t size) { return s_allocate (size); }
+void* operator new (size_t size, const std::nothrow_t&) noexcept
+{
+    try { return s_allocate (size); } catch (...) { return NULL; }
+}
+void* operator new[] (size_t size, const std::nothrow_t&) noexcept
+{
+    try { return s_allocate (size); } catch (...) { return NULL; }
+}
+void operator delete (void *ptr) noexcept { free (ptr); }
+void operator delete[] (void *ptr) noexcept { free (ptr); }
+void operator delete (void *ptr, const std::nothrow_t&) noexcept { free (ptr); }
+void operator delete[] (void *ptr, const std::nothrow_t&) noexcept { free (ptr); }
+
+// ----------------------------------------------------------------------------
+// benchmark runner
+
+struct Result {
+    std::string name;
+    uint64_t iterations;
+    double ns;
+    double bytes;
+    double allocations;
+};
+
+static int64_t s_min_time_ns = 200 * 1000 * 1000;
+
+// run op (n) with growing n until it takes at least s_min_time_ns
+template <typename Op>
+static Result
+s_run (const std::string& name, Op op)
+{
+    Result ret {name, 0, 0, 0, 0};
+    for (uint64_t n = 1; ; n *= 2) {
+        uint64_t allocations = s_allocations.load ();
+        uint64_t bytes = s_bytes.load ();
+        auto start = std::chrono::steady_clock::now ();
+        op (n);
+        int64_t elapsed = std::chrono::duration_cast <std::chrono::nanoseconds> (
+                std::chrono::steady_clock::now () - start).count ();
+        if (elapsed >= s_min_time_ns || n >= (1ULL << 32)) {
+            ret.iterations = n;
+            ret.ns = static_cast <double> (elapsed) / n;
+            ret.bytes = static_cast <double> (s_bytes.load () - bytes) / n;
+            ret.allocations = static_cast <double> (s_allocations.load () - allocations) / n;
+            return ret;
+        }
+    }
+}
+
+// keep the result alive, so the compiler does not drop the benchmarked call
+template <typename T>
+static void
+s_use (const T& value)
+{
+    __asm__ __volatile__ ("" : : "g" (&value) : "memory");
+}
+
+static std::string
+s_write_file (const std::string& dir, const char *name, size_t size)
+{
+    std::string path = dir + "/" + name;
+    std::ofstream file (path.c_str (), std::ios::binary);
+    // text file, so it is quoted-printable encoded like most attachments
+    for (size_t i = 0; i != size; i++)
+        file.put (i % 73 == 72 ? '\n' : static_cast <char> ('a' + i % 26));
+    return path;
+}
+
+static std::vector <Result>
+s_benchmarks (const std::string& dir)
+{
+    std::vector <Result> results;
+
+    // msg2email, message is consumed, so each op gets a copy
+    std::string small = s_write_file (dir, "small.txt", 4 * 1024);
+    std::string big = s_write_file (dir, "big.txt", 64 * 1024);
+    Smtp smtp;
+    smtp.from ("bench@example.com");
+    zhash_t *headers = zhash_new ();
+    zhash_update (headers, "X-Bench", (void*) "fty-email-microbench");
+    std::string body (2048, 'b');
+    struct {
+        const char *name;
+        zmsg_t *msg;
+    } mails [] = {
+        {"msg2email/0", fty_email_encode ("UUID", "joe@example.com", "subject", headers, body.c_str (), NULL)},
+        {"msg2email/1x4k", fty_email_encode ("UUID", "joe@example.com", "subject", headers, body.c_str (),
+                small.c_str (), NULL)},
+        {"msg2email/4x64k", fty_email_encode ("UUID", "joe@example.com", "subject", headers, body.c_str (),
+                big.c_str (), big.c_str (), big.c_str (), big.c_str (), NULL)}
+    };
+    for (auto& mail : mails) {
+        results.push_back (s_run (mail.name, [&smtp, &mail] (uint64_t n) {
+            for (uint64_t i = 0; i != n; i++) {
+                zmsg_t *msg = zmsg_dup (mail.msg);
+                std::string email = smtp.msg2email (&msg);
+                s_use (email);
+            }
+        }));
+        zmsg_destroy (&mail.msg);
+    }
+
+    results.push_back (s_run ("fty_email_encode", [&headers, &body] (uint64_t n) {
+        for (uint64_t i = 0; i != n; i++) {
+            zmsg_t *msg = fty_email_encode ("UUID", "joe@example.com", "subject", headers, body.c_str (), NULL);
+            s_use (msg);
+            zmsg_destroy (&msg);
+        }
+    }));
+    zhash_destroy (&headers);
+
+    // personal copies, MIME body is rendered once for all of them
+    Email each;
+    for (int i = 0; i != 10; i++)
+        each.to.push_back ("user" + std::to_string (i) + "@example.com");
+    each.subject = "subject";
+    each.body = body;
+    each.attachments.push_back (small);
+    results.push_back (s_run ("render_each/10x4k", [&smtp, &each] (uint64_t n) {
+        for (uint64_t i = 0; i != n; i++)
+            s_use (smtp.render_each (each));
+    }));
+
+    // alert rendering
+    zlist_t *actions = zlist_new ();
+    zlist_append (actions, (void *) "EMAIL");
+    const char *description = "{ \"key\": \"Device {{var1}} does not provide expected data. "
+        "It may be offline or not correctly configured.\", \"variables\": { \"var1\": \"ASSET1\" } }";
+    zmsg_t *msg = fty_proto_encode_alert (NULL, zclock_time () / 1000, 600, "NY_RULE", "ASSET1",
+            "ACTIVE", "CRITICAL", description, actions);
+    zlist_destroy (&actions);
+    fty_proto_t *alert = fty_proto_decode (&msg);
+    std::string priority = "1", extname = "Asset 1";
+    results.push_back (s_run ("generate_subject", [alert, &priority, &extname] (uint64_t n) {
+        for (uint64_t i = 0; i != n; i++)
+            s_use (generate_subject (alert, priority, extname));
+    }));
+    results.push_back (s_run ("generate_body", [alert, &priority, &extname] (uint64_t n) {
+        for (uint64_t i = 0; i != n; i++)
+            s_use (generate_body (alert, priority, extname));
+    }));
+    fty_proto_destroy (&alert);
+
+    std::string text = "Alert __rulename__ on __assetname__ is __state__, severity __severity__, "
+        "priority __priority__: __description__";
+    results.push_back (s_run ("replace_tokens", [&text] (uint64_t n) {
+        for (uint64_t i = 0; i != n; i++) {
+            std::string result = text;
+            replace_tokens (result, "__rulename__", "NY_RULE");
+            replace_tokens (result, "__assetname__", "Asset 1");
+            replace_tokens (result, "__description__", "Device Asset 1 does not provide expected data.");
+            s_use (result);
+        }
+    }));
+
+    std::string gw_template = "0#####@hyper.mobile", number = "+79 (0) 123456";
+    results.push_back (s_run ("sms_email_address", [&gw_template, &number] (uint64_t n) {
+        for (uint64_t i = 0; i != n; i++)
+            s_use (sms_email_address (gw_template, number));
+    }));
+    SmsTemplate sms_template {gw_template};
+    results.push_back (s_run ("SmsTemplate::address", [&sms_template, &number] (uint64_t n) {
+        for (uint64_t i = 0; i != n; i++)
+            s_use (sms_template.address (number));
+    }));
+
+    std::vector <std::string> errors = {
+        "msmtp: cannot connect to mail.example.com, port 25: Connection refused",
+        "msmtp: recipient address joe@example.com not accepted by the server\n"
+            "msmtp: server message: 550 5.1.1 mailbox unavailable",
+        "msmtp: authentication failed (method PLAIN)\nmsmtp: server message: 535 5.7.8 bad credentials",
+        "something completely different"
+    };
+    results.push_back (s_run ("msmtp_stderr2code", [&errors] (uint64_t n) {
+        for (uint64_t i = 0; i != n; i++)
+            s_use (msmtp_stderr2code (errors [i % errors.size ()]));
+    }));
+
+    results.push_back (s_run ("getIpAddr", [] (uint64_t n) {
+        for (uint64_t i = 0; i != n; i++)
+            s_use (getIpAddr ());
+    }));
+
+    unlink (small.c_str ());
+    unlink (big.c_str ());
+    return results;
+}
+
+// ----------------------------------------------------------------------------
+// baseline
+
+// file format: comment lines start with #, then "name ns/op bytes/op allocations/op"
+// missing or empty baseline is an error, comparing with it would always pass
+static std::map <std::string, Result>
+s_load (const char *path)
+{
+    std::map <std::string, Result> ret;
+    std::ifstream file (path);
+    if (!file) {
+        log_error ("Can't read baseline %s", path);
+        exit (EXIT_FAILURE);
+    }
+    std::string line;
+    while (std::getline (file, line)) {
+        if (line.empty () || line [0] == '#')
+            continue;
+        std::istringstream in (line);
+        Result r {"", 0, 0, 0, 0};
+        if (in >> r.name >> r.ns >> r.bytes >> r.allocations)
+            ret [r.name] = r;
+    }
+    if (ret.empty ()) {
+        log_error ("Baseline %s has no results, record it by --save", path);
+        exit (EXIT_FAILURE);
+    }
+    return ret;
+}
+
+static void
+s_save (const char *path, const std::vector <Result>& results)
+{
+    FILE *file = fopen (path, "w");
+    if (!file) {
+        log_error ("Can't write baseline %s: %s", path, strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    fprintf (file, "# fty-email-microbench baseline, regenerate by fty-email-microbench --save\n");
+    fprintf (file, "# name ns/op bytes/op allocations/op\n");
+    for (const auto& r : results)
+        fprintf (file, "%s %.1f %.1f %.2f\n", r.name.c_str (), r.ns, r.bytes, r.allocations);
+    fclose (file);
+}
+
+void usage ()
+{
+    puts ("fty-email-microbench [options]\n"
+          "  -s|--save FILE        write results as the new baseline\n"
+          "  -c|--compare FILE     compare results with the baseline, fail on regression\n"
+          "  -r|--threshold PCT    allowed ns/op regression in percent [10]\n"
+          "  -t|--time MS          minimal time of each benchmark in milliseconds [200]\n"
+          "  -T|--translations DIR directory with test_*.json translations [src/selftest-ro]\n"
+          "  -h|--help             print this information");
+}
+
+int main (int argc, char** argv)
+{
+    int help = 0;
+    const char *save = NULL;
+    const char *compare = NULL;
+    double threshold = 10;
+    const char *translations = "src/selftest-ro";
+    ManageFtyLog::setInstanceFtylog ("fty-email-microbench");
+
+    // get options
+    int c;
+// Some systems define struct option with non-"const" "char *"
+#if defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wwrite-strings"
+#endif
+    static const char *short_options = "hs:c:r:t:T:";
+    static struct option long_options[] =
+    {
+        {"help",         no_argument,       &help,    1},
+        {"save",         required_argument, 0,'s'},
+        {"compare",      required_argument, 0,'c'},
+        {"threshold",    required_argument, 0,'r'},
+        {"time",         required_argument, 0,'t'},
+        {"translations", required_argument, 0,'T'},
+        {NULL, 0, 0, 0}
+    };
+#if defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic pop
+#endif
+
+    while(true) {
+
+        int option_index = 0;
+        c = getopt_long (argc, argv, short_options, long_options, &option_index);
+        if (c == -1) break;
+        switch (c) {
+        case 's':
+            save = optarg;
+            break;
+        case 'c':
+            compare = optarg;
+            break;
+        case 'r':
+            threshold = atof (optarg);
+            break;
+        case 't':
+            s_min_time_ns = std::max (atoll (optarg), 1LL) * 1000 * 1000;
+            break;
+        case 'T':
+            translations = optarg;
+            break;
+        case 0:
+            // just now walking trough some long opt
+            break;
+        case 'h':
+        default:
+            help = 1;
+            break;
+        }
+    }
+    if (help) { usage(); exit(1); }
+    // end of the options
+
+    if (translation_initialize (FTY_EMAIL_ADDRESS, translations, "test_") != TE_OK)
+        log_warning ("Translation not initialized from %s", translations);
+
+    char dir [] = "/tmp/fty-email-microbench-XXXXXX";
+    if (!mkdtemp (dir)) {
+        log_error ("Can't create temporary directory: %s", strerror (errno));
+        exit (EXIT_FAILURE);
+    }
+    std::vector <Result> results = s_benchmarks (dir);
+    rmdir (dir);
+
+    std::map <std::string, Result> baseline;
+    if (compare)
+        baseline = s_load (compare);
+
+    int regressions = 0;
+    printf ("%-20s %12s %12s %12s %10s", "benchmark", "iterations", "ns/op", "bytes/op", "allocs/op");
+    if (compare)
+        printf (" %12s %8s", "base ns/op", "delta");
+    printf ("\n");
+    for (const auto& r : results) {
+        printf ("%-20s %12" PRIu64 " %12.1f %12.1f %10.2f", r.name.c_str (), r.iterations, r.ns, r.bytes, r.allocations);
+        auto it = baseline.find (r.name);
+        if (it != baseline.end ()) {
+            double delta = it->second.ns > 0 ? (r.ns - it->second.ns) * 100 / it->second.ns : 0;
+            bool regression = delta > threshold || r.allocations > it->second.allocations + 0.005;
+            printf (" %12.1f %+7.1f%%%s", it->second.ns, delta, regression ? "  REGRESSION" : "");
+            if (regression)
+                regressions ++;
+        }
+        else
+        if (compare)
+            printf (" %12s %8s", "-", "new");
+        printf ("\n");
+    }
+
+    if (save)
+        s_save (save, results);
+    if (regressions)
+        printf ("%d benchmark(s) regressed against %s\n", regressions, compare);
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -38,10 +38,32 @@ void
 fty_email_private_selftest (bool verbose, const char *subtest)
 {
 // Tests for stable private classes:
+    if (streq (subtest, "$ALL") || streq (subtest, "arena_test"))
+        arena_test (verbose);
     if (streq (subtest, "$ALL") || streq (subtest, "emailconfiguration_test"))
         emailconfiguration_test (verbose);
     if (streq (subtest, "$ALL") || streq (subtest, "email_test"))
         email_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "rendercache_test"))
+        rendercache_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "configwatch_test"))
+        configwatch_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "hashring_test"))
+        hashring_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "metrics_test"))
+        metrics_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "trace_test"))
+        trace_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "flightrecorder_test"))
+        flightrecorder_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "admission_test"))
+        admission_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "mailqueue_test"))
+        mailqueue_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "emailworker_test"))
+        emailworker_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "capture_test"))
+        capture_test (verbose);
 }
 /*
 ################################################################################
@@ -44,8 +44,19 @@ all_tests [] = {
 #ifdef FTY_EMAIL_BUILD_DRAFT_API
 // Tests for stable/draft private classes:
 // Now built only with --enable-drafts, so even stable builds are hidden behind the flag
+    { "arena", NULL, true, false, "arena_test" },
     { "emailconfiguration", NULL, true, false, "emailconfiguration_test" },
     { "email", NULL, true, false, "email_test" },
+    { "rendercache", NULL, true, false, "rendercache_test" },
+    { "configwatch", NULL, true, false, "configwatch_test" },
+    { "hashring", NULL, true, false, "hashring_test" },
+    { "metrics", NULL, true, false, "metrics_test" },
+    { "trace", NULL, true, false, "trace_test" },
+    { "flightrecorder", NULL, true, false, "flightrecorder_test" },
+    { "admission", NULL, true, false, "admission_test" },
+    { "mailqueue", NULL, true, false, "mailqueue_test" },
+    { "emailworker", NULL, true, false, "emailworker_test" },
+    { "capture", NULL, true, false, "capture_test" },
     { "private_classes", NULL, false, false, "$ALL" }, // compat option for older projects
 #endif // FTY_EMAIL_BUILD_DRAFT_API
     {NULL, NULL, 0, 0, NULL}          //  Sentinel
@@ -42,6 +42,8 @@ void usage ()
           "  -c|--config           path to fty-email config file\n"
           "  -s|--subject          mail subject\n"
           "  -a|--attachment       path to file to be attached to email\n"
+          "  -A|--async            return once the email is accepted, print its uuid, final status\n"
+          "                        is published on malamute/producer stream of fty-email\n"
           "Send email through fty-email to given recipients in email body.\n"
           "Email body is read from stdin\n"
           "\n"
@@ -53,6 +55,7 @@ int main (int argc, char** argv)
 
     int help = 0;
     int verbose = 0;
+    int async = 0;
     std::vector<std::string> attachments;
     const char *recipient = NULL;
     std::string subj;
@@ -65,11 +68,12 @@ int main (int argc, char** argv)
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wwrite-strings"
 #endif
-    static const char *short_options = "vc:s:a:";
+    static const char *short_options = "vAc:s:a:";
     static struct option long_options[] =
     {
         {"help",       no_argument,       &help,    1},
         {"verbose",    no_argument,       &verbose, 1},
+        {"async",      no_argument,       &async,   1},
         {"config",     required_argument, 0,'c'},
         {"subject",    required_argument, 0,'s'},
         {"attachment", required_argument, 0,'a'},
@@ -91,6 +95,9 @@ int main (int argc, char** argv)
         case 'v':
             verbose = 1;
             break;
+        case 'A':
+            async = 1;
+            break;
         case 'c':
             config_file = optarg;
             break;
@@ -161,9 +168,11 @@ int main (int argc, char** argv)
     zstr_free (&endpoint);
     assert (r != -1);
 
+    // status of asynchronous email is published under its uuid, so it must be unique
+    zuuid_t *mail_uuid = zuuid_new ();
     std::string body = MlmSubprocess::read_all (STDIN_FILENO);
     zmsg_t *mail = fty_email_encode (
-        "UUID",
+        async ? zuuid_str (mail_uuid) : "UUID",
         recipient,
         subj.c_str (),
         NULL,
@@ -171,12 +180,12 @@ int main (int argc, char** argv)
         NULL
         );
 
-    for (const auto file : attachments) {
+    for (const auto& file : attachments) {
         zmsg_addstr (mail, file.c_str());
     }
 
     zmsg_print (mail);
-    r = mlm_client_sendto (client, smtp_address, "SENDMAIL", NULL, 2000, &mail);
+    r = mlm_client_sendto (client, smtp_address, async ? "SENDMAIL_ASYNC" : "SENDMAIL", NULL, 2000, &mail);
     zstr_free (&smtp_address);
     if (r == -1) {
         log_error ("Failed to send the email (mlm_client_sendto returned -1).");
@@ -192,8 +201,10 @@ int main (int argc, char** argv)
     char* code = zmsg_popstr (msg);
     char* reason = zmsg_popstr (msg);
     int exit_code = EXIT_SUCCESS;
-    if (code[0] != '0')
+    if (!code || code[0] != '0')
         exit_code = EXIT_FAILURE;
+    if (async && exit_code == EXIT_SUCCESS)
+        puts (uuid);
 
     if (exit_code == EXIT_FAILURE)
         log_debug ("subject: %s, \ncode: %s \nreason: %s", mlm_client_subject (client), code, reason);
@@ -201,6 +212,7 @@ int main (int argc, char** argv)
     zstr_free(&code);
     zstr_free(&reason);
     zstr_free(&uuid);
+    zuuid_destroy (&mail_uuid);
     mlm_client_destroy (&client);
 
     exit (exit_code);
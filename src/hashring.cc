@@ -0,0 +1,118 @@
+/*  =========================================================================
+    hashring - Consistent hash ring for sharding of recipients
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    hashring - Consistent hash ring for sharding of recipients
+@discuss
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <map>
+#include <algorithm>
+
+uint64_t
+HashRing::hash (const char *key, size_t size)
+{
+    uint64_t ret = 14695981039346656037ULL;
+    for (size_t i = 0; i != size; i++) {
+        ret ^= static_cast <uint8_t> (key [i]);
+        ret *= 1099511628211ULL;
+    }
+    // FNV has weak avalanche on the last bytes, finish it by murmur3 fmix
+    ret ^= ret >> 33;
+    ret *= 0xff51afd7ed558ccdULL;
+    ret ^= ret >> 33;
+    ret *= 0xc4ceb9fe1a85ec53ULL;
+    ret ^= ret >> 33;
+    return ret;
+}
+
+void
+HashRing::add (size_t node, const std::string& name)
+{
+    for (size_t i = 0; i != _replicas; i++) {
+        std::string replica = name + "#" + std::to_string (i);
+        _ring.emplace_back (hash (replica.data (), replica.size ()), node);
+    }
+    std::sort (_ring.begin (), _ring.end ());
+}
+
+size_t
+HashRing::node (const char *key, size_t size) const
+{
+    assert (!_ring.empty ());
+    std::pair <uint64_t, size_t> needle {hash (key, size), 0};
+    auto it = std::lower_bound (_ring.begin (), _ring.end (), needle);
+    if (it == _ring.end ())
+        it = _ring.begin ();
+    return it->second;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+hashring_test (bool verbose)
+{
+    printf (" * hashring: ");
+
+    //  @selftest
+    HashRing ring;
+    assert (ring.empty ());
+    for (size_t i = 0; i != 4; i++)
+        ring.add (i, "worker-" + std::to_string (i));
+    assert (!ring.empty ());
+
+    // stable mapping
+    assert (ring.node ("joe@example.com") == ring.node ("joe@example.com"));
+
+    // keys are spread over all nodes
+    std::map <size_t, size_t> counts;
+    std::vector <size_t> before;
+    for (size_t i = 0; i != 10000; i++) {
+        size_t node = ring.node ("user" + std::to_string (i) + "@example.com");
+        assert (node < 4);
+        counts [node] ++;
+        before.push_back (node);
+    }
+    assert (counts.size () == 4);
+    for (const auto& it : counts)
+        assert (it.second > 1500 && it.second < 3500);
+
+    // adding a node moves only keys to the new node
+    ring.add (4, "worker-4");
+    size_t moved = 0;
+    for (size_t i = 0; i != 10000; i++) {
+        size_t node = ring.node ("user" + std::to_string (i) + "@example.com");
+        if (node != before [i]) {
+            assert (node == 4);
+            moved ++;
+        }
+    }
+    assert (moved > 1000 && moved < 3000);
+    //  @end
+
+    printf ("OK\n");
+}
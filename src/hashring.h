@@ -0,0 +1,72 @@
+/*  =========================================================================
+    hashring - Consistent hash ring for sharding of recipients
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef HASHRING_H_INCLUDED
+#define HASHRING_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+/**
+ * \class HashRing
+ *
+ * \brief Consistent hash ring mapping keys (recipients) to nodes (workers)
+ *
+ * Each node is placed on the ring many times (virtual nodes), key belongs
+ * to the first node clockwise from its hash. The same key is always mapped
+ * to the same node, so messages for one recipient are processed in order,
+ * and adding a node moves only about 1/n of keys.
+ */
+class HashRing
+{
+    public:
+        static const size_t DEFAULT_REPLICAS = 128;
+
+        explicit HashRing (size_t replicas = DEFAULT_REPLICAS):
+            _replicas {replicas},
+            _ring {}
+        {}
+
+        /** \brief add node with given index and name, name determines its positions */
+        void add (size_t node, const std::string& name);
+
+        /** \brief return node index for key, ring must not be empty */
+        size_t node (const char *key, size_t size) const;
+        size_t node (const std::string& key) const { return node (key.data (), key.size ()); }
+
+        bool empty () const { return _ring.empty (); }
+
+        /** \brief 64 bit FNV-1a hash */
+        static uint64_t hash (const char *key, size_t size);
+
+    protected:
+        size_t _replicas;
+        // sorted by hash
+        std::vector <std::pair <uint64_t, size_t>> _ring;
+};
+
+void
+hashring_test (bool verbose);
+
+#endif // HASHRING_H_INCLUDED
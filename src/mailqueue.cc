@@ -0,0 +1,251 @@
+/*  =========================================================================
+    mailqueue - Bounded lock-free queue of mailbox messages for a worker
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    mailqueue - Bounded lock-free queue of mailbox messages for a worker
+@discuss
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+MailQueue::MailQueue (size_t capacity, MemoryBudget *budget):
+    _queue {capacity},
+    _budget {budget},
+    _waiting {false},
+    _fd {-1}
+{
+    _fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_fd == -1)
+        throw std::runtime_error (std::string ("eventfd failed: ") + strerror (errno));
+}
+
+MailQueue::~MailQueue ()
+{
+    zmsg_t *msg;
+    size_t charge;
+    Trace *trace;
+    while ((msg = pop (&charge, &trace)) != NULL) {
+        zmsg_destroy (&msg);
+        delete trace;
+        if (_budget)
+            _budget->release (charge);
+    }
+    close (_fd);
+}
+
+bool
+MailQueue::push (zmsg_t **msg_p, size_t charge, Trace *trace)
+{
+    assert (msg_p);
+    if (!_queue.push (Item {*msg_p, charge, trace}))
+        return false;
+    *msg_p = NULL;
+
+    // pairs with the fence in prepare_wait: either consumer sees the message,
+    // or we see it is waiting
+    std::atomic_thread_fence (std::memory_order_seq_cst);
+    if (_waiting.load (std::memory_order_relaxed) && _waiting.exchange (false)) {
+        uint64_t one = 1;
+        ssize_t r = write (_fd, &one, sizeof (one));
+        if (r == -1)
+            log_error ("write to eventfd failed: %s", strerror (errno));
+    }
+    return true;
+}
+
+zmsg_t*
+MailQueue::pop (size_t *charge_p, Trace **trace_p)
+{
+    Item item;
+    if (!_queue.pop (item))
+        return NULL;
+    if (charge_p)
+        *charge_p = item.charge;
+    if (trace_p)
+        *trace_p = item.trace;
+    else
+        delete item.trace;
+    return item.msg;
+}
+
+bool
+MailQueue::prepare_wait ()
+{
+    _waiting.store (true, std::memory_order_relaxed);
+    std::atomic_thread_fence (std::memory_order_seq_cst);
+    if (!_queue.empty ()) {
+        _waiting.store (false, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void
+MailQueue::awake ()
+{
+    _waiting.store (false, std::memory_order_relaxed);
+    uint64_t value;
+    while (read (_fd, &value, sizeof (value)) > 0)
+        ;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static bool
+s_readable (int fd, int timeout)
+{
+    struct pollfd item = {fd, POLLIN, 0};
+    return poll (&item, 1, timeout) == 1;
+}
+
+void
+mailqueue_test (bool verbose)
+{
+    printf (" * mailqueue: ");
+
+    //  @selftest
+    {
+        BoundedQueue <int> queue {5};
+        assert (queue.capacity () == 8);
+        assert (queue.empty ());
+        for (int i = 0; i != 8; i++)
+            assert (queue.push (i));
+        assert (!queue.push (8));
+        assert (queue.size () == 8);
+        assert (!queue.empty ());
+        int value;
+        for (int i = 0; i != 8; i++) {
+            assert (queue.pop (value));
+            assert (value == i);
+        }
+        assert (!queue.pop (value));
+        assert (queue.push (42));
+        assert (queue.pop (value) && value == 42);
+    }
+
+    // full queue rejects the message and leaves it to the caller
+    MemoryBudget budget {0};
+    {
+        MailQueue queue {2, &budget};
+        for (int i = 0; i != 2; i++) {
+            zmsg_t *msg = zmsg_new ();
+            zmsg_addstrf (msg, "%d", i);
+            assert (budget.try_acquire (10));
+            assert (queue.push (&msg, 10, new Trace {std::to_string (i)}));
+            assert (!msg);
+        }
+        assert (queue.size () == 2);
+        zmsg_t *msg = zmsg_new ();
+        assert (!queue.push (&msg));
+        assert (msg);
+        zmsg_destroy (&msg);
+
+        size_t charge = 0;
+        Trace *trace = NULL;
+        msg = queue.pop (&charge, &trace);
+        assert (charge == 10);
+        assert (trace && trace->uuid == "0");
+        delete trace;
+        budget.release (charge);
+        char *s = zmsg_popstr (msg);
+        assert (streq (s, "0"));
+        zstr_free (&s);
+        zmsg_destroy (&msg);
+        // the other message and its trace are destroyed with the queue
+    }
+    assert (budget.used () == 0);
+
+    // consumer is woken up only if it announced the wait
+    {
+        MailQueue queue;
+        zmsg_t *msg = zmsg_new ();
+        assert (queue.push (&msg));
+        assert (!s_readable (queue.fd (), 0));
+        assert (!queue.prepare_wait ());
+        msg = queue.pop ();
+        zmsg_destroy (&msg);
+
+        assert (queue.prepare_wait ());
+        msg = zmsg_new ();
+        assert (queue.push (&msg));
+        assert (s_readable (queue.fd (), 0));
+        queue.awake ();
+        assert (!s_readable (queue.fd (), 0));
+        msg = queue.pop ();
+        assert (msg);
+        zmsg_destroy (&msg);
+    }
+
+    // producers racing with a sleeping consumer, nothing is lost
+    {
+        const int PRODUCERS = 4;
+        const int COUNT = 10000;
+        MailQueue queue {64};
+        std::vector <std::thread> producers;
+        for (int p = 0; p != PRODUCERS; p++) {
+            producers.emplace_back ([&queue, p] {
+                for (int i = 0; i != COUNT; i++) {
+                    zmsg_t *msg = zmsg_new ();
+                    zmsg_addmem (msg, &p, sizeof (p));
+                    zmsg_addmem (msg, &i, sizeof (i));
+                    while (!queue.push (&msg))
+                        std::this_thread::yield ();
+                }
+            });
+        }
+
+        int next [PRODUCERS] = {0};
+        for (int received = 0; received != PRODUCERS * COUNT; ) {
+            zmsg_t *msg = queue.pop ();
+            if (!msg) {
+                if (queue.prepare_wait ()) {
+                    assert (s_readable (queue.fd (), 5000));
+                }
+                queue.awake ();
+                continue;
+            }
+            zframe_t *frame = zmsg_first (msg);
+            int p = *(int*) zframe_data (frame);
+            frame = zmsg_next (msg);
+            int i = *(int*) zframe_data (frame);
+            // per producer order is kept
+            assert (i == next [p]);
+            next [p] ++;
+            received ++;
+            zmsg_destroy (&msg);
+        }
+        for (auto& t : producers)
+            t.join ();
+        assert (!queue.pop ());
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,234 @@
+/*  =========================================================================
+    mailqueue - Bounded lock-free queue of mailbox messages for a worker
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef MAILQUEUE_H_INCLUDED
+#define MAILQUEUE_H_INCLUDED
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * \class BoundedQueue
+ *
+ * \brief Bounded lock-free multi producer/multi consumer queue
+ *
+ * Array based queue by Dmitry Vyukov: each cell carries a sequence number,
+ * which tells producers and consumers whether the cell is free or full,
+ * so push and pop are one CAS on the position in the common case and
+ * never block. Capacity is rounded up to a power of two.
+ */
+template <typename T>
+class BoundedQueue
+{
+    public:
+        explicit BoundedQueue (size_t capacity):
+            _mask {s_round_up (capacity) - 1},
+            _cells {new Cell [_mask + 1]},
+            _enqueue_pos {0},
+            _dequeue_pos {0}
+        {
+            for (size_t i = 0; i != _mask + 1; i++)
+                _cells [i].sequence.store (i, std::memory_order_relaxed);
+        }
+
+        BoundedQueue (const BoundedQueue&) = delete;
+        BoundedQueue& operator= (const BoundedQueue&) = delete;
+
+        /** \brief push value, return false if queue is full */
+        bool push (const T& value)
+        {
+            Cell *cell;
+            size_t pos = _enqueue_pos.load (std::memory_order_relaxed);
+            while (true) {
+                cell = &_cells [pos & _mask];
+                size_t seq = cell->sequence.load (std::memory_order_acquire);
+                intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+                if (diff == 0) {
+                    if (_enqueue_pos.compare_exchange_weak (pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else
+                if (diff < 0)
+                    return false;
+                else
+                    pos = _enqueue_pos.load (std::memory_order_relaxed);
+            }
+            cell->data = value;
+            cell->sequence.store (pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        /** \brief pop value, return false if queue is empty */
+        bool pop (T& value)
+        {
+            Cell *cell;
+            size_t pos = _dequeue_pos.load (std::memory_order_relaxed);
+            while (true) {
+                cell = &_cells [pos & _mask];
+                size_t seq = cell->sequence.load (std::memory_order_acquire);
+                intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+                if (diff == 0) {
+                    if (_dequeue_pos.compare_exchange_weak (pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else
+                if (diff < 0)
+                    return false;
+                else
+                    pos = _dequeue_pos.load (std::memory_order_relaxed);
+            }
+            value = cell->data;
+            cell->sequence.store (pos + _mask + 1, std::memory_order_release);
+            return true;
+        }
+
+        /** \brief true if there is nothing to pop, exact only when called by the consumer */
+        bool empty () const
+        {
+            size_t pos = _dequeue_pos.load (std::memory_order_relaxed);
+            const Cell& cell = _cells [pos & _mask];
+            return cell.sequence.load (std::memory_order_acquire) != pos + 1;
+        }
+
+        /** \brief number of queued items, approximate if queue is used meanwhile */
+        size_t size () const
+        {
+            size_t dequeue = _dequeue_pos.load (std::memory_order_relaxed);
+            size_t enqueue = _enqueue_pos.load (std::memory_order_relaxed);
+            return enqueue > dequeue ? enqueue - dequeue : 0;
+        }
+
+        size_t capacity () const { return _mask + 1; }
+
+    protected:
+        static const size_t CACHELINE = 64;
+
+        struct Cell {
+            std::atomic <size_t> sequence;
+            T data;
+        };
+
+        static size_t s_round_up (size_t n)
+        {
+            size_t ret = 2;
+            while (ret < n)
+                ret <<= 1;
+            return ret;
+        }
+
+        // producers and consumers touch different cache lines
+        char _pad0 [CACHELINE];
+        const size_t _mask;
+        std::unique_ptr <Cell[]> _cells;
+        char _pad1 [CACHELINE];
+        std::atomic <size_t> _enqueue_pos;
+        char _pad2 [CACHELINE];
+        std::atomic <size_t> _dequeue_pos;
+        char _pad3 [CACHELINE];
+};
+
+/**
+ * \class MailQueue
+ *
+ * \brief Queue of mailbox messages from the dispatcher to one worker
+ *
+ * Dispatcher pushes messages, worker pops them. When worker has nothing
+ * to do, it waits on fd () (eventfd), which is signaled by the first push
+ * after the worker announced the wait, so a busy worker costs producers
+ * no syscall.
+ *
+ * Each message carries its charge of the MemoryBudget, which is released
+ * by the consumer when the message is processed, or by the queue when it
+ * is destroyed with the message, and its Trace, which is owned by the queue
+ * until the message is popped.
+ *
+ * Consumer loop:
+ *
+ *      zmsg_t *msg = queue.pop ();
+ *      if (!msg && queue.prepare_wait ()) {
+ *          poll (queue.fd ()) ...
+ *          queue.awake ();
+ *      }
+ */
+class MailQueue
+{
+    public:
+        static const size_t DEFAULT_CAPACITY = 1024;
+
+        explicit MailQueue (size_t capacity = DEFAULT_CAPACITY, MemoryBudget *budget = NULL);
+        /** \brief destroys messages (and traces) which were not processed and releases their charge */
+        ~MailQueue ();
+
+        MailQueue (const MailQueue&) = delete;
+        MailQueue& operator= (const MailQueue&) = delete;
+
+        /**
+         * \brief push message, on success queue takes ownership and *msg_p is NULL
+         *
+         * \return false if queue is full, message is left to caller
+         */
+        bool push (zmsg_t **msg_p, size_t charge = 0, Trace *trace = NULL);
+
+        /**
+         * \brief pop message, NULL if queue is empty
+         *
+         * Charge and trace of the message are stored if asked for, caller
+         * takes over the trace.
+         */
+        zmsg_t* pop (size_t *charge_p = NULL, Trace **trace_p = NULL);
+
+        /**
+         * \brief announce consumer is going to wait on fd ()
+         *
+         * \return false if message arrived meanwhile and consumer must not wait
+         */
+        bool prepare_wait ();
+
+        /** \brief consumer is awake, consume the signal on fd () */
+        void awake ();
+
+        /** \brief descriptor readable when consumer waiting on it should wake up */
+        int fd () const { return _fd; }
+
+        size_t capacity () const { return _queue.capacity (); }
+        /** \brief number of queued messages, approximate */
+        size_t size () const { return _queue.size (); }
+
+    protected:
+        struct Item {
+            zmsg_t *msg;
+            size_t charge;
+            Trace *trace;
+        };
+
+        BoundedQueue <Item> _queue;
+        MemoryBudget *_budget;
+        std::atomic <bool> _waiting;
+        int _fd;
+};
+
+void
+mailqueue_test (bool verbose);
+
+#endif // MAILQUEUE_H_INCLUDED
@@ -0,0 +1,387 @@
+/*  =========================================================================
+    metrics - Registry of counters, gauges and histograms of the agent
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    metrics - Registry of counters, gauges and histograms of the agent
+@discuss
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+
+Histogram::Histogram ():
+    _count {0},
+    _sum {0},
+    _min {UINT64_MAX},
+    _max {0},
+    _buckets {new std::atomic <uint64_t> [BUCKETS]}
+{
+    for (size_t i = 0; i != BUCKETS; i++)
+        _buckets [i].store (0, std::memory_order_relaxed);
+}
+
+size_t
+Histogram::s_index (uint64_t value)
+{
+    if (value < 2 * SUB_COUNT)
+        return static_cast <size_t> (value);
+    unsigned exponent = 63 - __builtin_clzll (value);
+    return (exponent - SUB_BITS) * SUB_COUNT + static_cast <size_t> (value >> (exponent - SUB_BITS));
+}
+
+uint64_t
+Histogram::s_lowest (size_t index)
+{
+    if (index < 2 * SUB_COUNT)
+        return index;
+    unsigned exponent = static_cast <unsigned> (index / SUB_COUNT) + SUB_BITS - 1;
+    uint64_t sub = index % SUB_COUNT + SUB_COUNT;
+    return sub << (exponent - SUB_BITS);
+}
+
+void
+Histogram::record (uint64_t value)
+{
+    _buckets [s_index (value)].fetch_add (1, std::memory_order_relaxed);
+    _count.fetch_add (1, std::memory_order_relaxed);
+    _sum.fetch_add (value, std::memory_order_relaxed);
+
+    uint64_t min = _min.load (std::memory_order_relaxed);
+    while (value < min && !_min.compare_exchange_weak (min, value, std::memory_order_relaxed))
+        ;
+    uint64_t max = _max.load (std::memory_order_relaxed);
+    while (value > max && !_max.compare_exchange_weak (max, value, std::memory_order_relaxed))
+        ;
+}
+
+uint64_t
+Histogram::min () const
+{
+    uint64_t min = _min.load (std::memory_order_relaxed);
+    return min == UINT64_MAX ? 0 : min;
+}
+
+uint64_t
+Histogram::percentile (double percentile) const
+{
+    uint64_t count = this->count ();
+    if (count == 0)
+        return 0;
+
+    uint64_t target = static_cast <uint64_t> (std::ceil (percentile / 100.0 * count));
+    if (target < 1)
+        target = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i != BUCKETS; i++) {
+        seen += _buckets [i].load (std::memory_order_relaxed);
+        if (seen >= target) {
+            uint64_t highest = i + 1 == BUCKETS ? UINT64_MAX : s_lowest (i + 1) - 1;
+            return std::max (std::min (highest, max ()), min ());
+        }
+    }
+    return max ();
+}
+
+Metrics&
+Metrics::global ()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+template <typename T>
+static T&
+s_lookup (std::mutex& mutex, std::map <std::string, std::unique_ptr <T>>& map, const std::string& name)
+{
+    std::lock_guard <std::mutex> lock (mutex);
+    std::unique_ptr <T>& item = map [name];
+    if (!item)
+        item.reset (new T ());
+    return *item;
+}
+
+Counter&
+Metrics::counter (const std::string& name)
+{
+    return s_lookup (_mutex, _counters, name);
+}
+
+Gauge&
+Metrics::gauge (const std::string& name)
+{
+    return s_lookup (_mutex, _gauges, name);
+}
+
+Histogram&
+Metrics::histogram (const std::string& name)
+{
+    return s_lookup (_mutex, _histograms, name);
+}
+
+std::string
+metrics_json_string (const std::string& str)
+{
+    std::string ret = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\')
+            ret.push_back ('\\');
+        if (static_cast <unsigned char> (c) < 0x20)
+            continue;
+        ret.push_back (c);
+    }
+    ret.push_back ('"');
+    return ret;
+}
+
+static const struct {
+    const char *name;
+    double percentile;
+} PERCENTILES [] = {
+    {"p50", 50.0},
+    {"p90", 90.0},
+    {"p99", 99.0},
+    {"p999", 99.9}
+};
+
+std::string
+Metrics::to_json () const
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    std::ostringstream out;
+
+    out << "{\"counters\": {";
+    const char *sep = "";
+    for (const auto& it : _counters) {
+        out << sep << metrics_json_string (it.first) << ": " << it.second->value ();
+        sep = ", ";
+    }
+
+    out << "}, \"gauges\": {";
+    sep = "";
+    for (const auto& it : _gauges) {
+        out << sep << metrics_json_string (it.first) << ": " << it.second->value ();
+        sep = ", ";
+    }
+
+    out << "}, \"histograms\": {";
+    sep = "";
+    for (const auto& it : _histograms) {
+        const Histogram& h = *it.second;
+        out << sep << metrics_json_string (it.first)
+            << ": {\"count\": " << h.count ()
+            << ", \"sum\": " << h.sum ()
+            << ", \"min\": " << h.min ()
+            << ", \"max\": " << h.max ();
+        for (const auto& p : PERCENTILES)
+            out << ", \"" << p.name << "\": " << h.percentile (p.percentile);
+        out << "}";
+        sep = ", ";
+    }
+    out << "}}";
+    return out.str ();
+}
+
+// requests.SENDMAIL -> fty_email_requests, metric without labels
+static std::string
+s_prometheus_family (const std::string& name, const std::string& suffix = "")
+{
+    std::string metric = "fty_email_";
+    for (char c : name.substr (0, name.find ('.')))
+        metric.push_back (isalnum (static_cast <unsigned char> (c)) ? c : '_');
+    return metric + suffix;
+}
+
+// requests.SENDMAIL -> fty_email_requests{key="SENDMAIL"}, extra is added to labels
+static std::string
+s_prometheus_name (const std::string& name, const std::string& suffix = "", const std::string& extra = "")
+{
+    std::string metric = s_prometheus_family (name, suffix);
+    std::string label;
+    size_t dot = name.find ('.');
+    if (dot != std::string::npos)
+        label = "key=" + metrics_json_string (name.substr (dot + 1));
+    if (!extra.empty ())
+        label += (label.empty () ? "" : ",") + extra;
+    if (!label.empty ())
+        metric += "{" + label + "}";
+    return metric;
+}
+
+std::string
+Metrics::to_prometheus () const
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    std::ostringstream out;
+    // maps are sorted, so labeled metrics of one family follow each other
+    // and get one TYPE line
+    std::string family;
+    auto type = [&out, &family] (const std::string& metric, const char *kind) {
+        if (metric == family)
+            return;
+        family = metric;
+        out << "# TYPE " << metric << " " << kind << "\n";
+    };
+
+    for (const auto& it : _counters) {
+        type (s_prometheus_family (it.first, "_total"), "counter");
+        out << s_prometheus_name (it.first, "_total") << " " << it.second->value () << "\n";
+    }
+    for (const auto& it : _gauges) {
+        type (s_prometheus_family (it.first), "gauge");
+        out << s_prometheus_name (it.first) << " " << it.second->value () << "\n";
+    }
+    for (const auto& it : _histograms) {
+        const Histogram& h = *it.second;
+        type (s_prometheus_family (it.first), "summary");
+        for (const auto& p : PERCENTILES) {
+            std::ostringstream quantile;
+            quantile << "quantile=\"" << p.percentile / 100.0 << "\"";
+            out << s_prometheus_name (it.first, "", quantile.str ()) << " " << h.percentile (p.percentile) << "\n";
+        }
+        out << s_prometheus_name (it.first, "_sum") << " " << h.sum () << "\n";
+        out << s_prometheus_name (it.first, "_count") << " " << h.count () << "\n";
+    }
+    return out.str ();
+}
+
+int
+Metrics::dump (const std::string& path) const
+{
+    std::string data = to_prometheus ();
+    // scraper must never see half written file
+    std::string tmp = path + ".tmp";
+    FILE *file = fopen (tmp.c_str (), "w");
+    if (!file) {
+        log_error ("can't write metrics to %s: %s", tmp.c_str (), strerror (errno));
+        return -1;
+    }
+    size_t written = fwrite (data.data (), 1, data.size (), file);
+    if (fclose (file) != 0 || written != data.size () || rename (tmp.c_str (), path.c_str ()) == -1) {
+        log_error ("can't write metrics to %s", path.c_str ());
+        unlink (tmp.c_str ());
+        return -1;
+    }
+    return 0;
+}
+
+int64_t
+metrics_now_us ()
+{
+    return std::chrono::duration_cast <std::chrono::microseconds> (
+            std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+metrics_test (bool verbose)
+{
+    printf (" * metrics: ");
+
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    //  @selftest
+    {
+        Histogram h;
+        assert (h.count () == 0);
+        assert (h.percentile (50) == 0);
+        assert (h.min () == 0);
+
+        // small values are exact
+        for (uint64_t i = 1; i <= 50; i++)
+            h.record (i);
+        assert (h.count () == 50);
+        assert (h.sum () == 1275);
+        assert (h.min () == 1);
+        assert (h.max () == 50);
+        assert (h.percentile (50) == 25);
+        assert (h.percentile (100) == 50);
+    }
+
+    {
+        // big values within 1/32
+        Histogram h;
+        for (uint64_t i = 1; i <= 100000; i++)
+            h.record (i * 1000);
+        uint64_t p50 = h.percentile (50);
+        uint64_t p99 = h.percentile (99);
+        assert (p50 >= 50000000 && p50 <= 50000000 + 50000000 / 32);
+        assert (p99 >= 99000000 && p99 <= 99000000 + 99000000 / 32);
+        assert (h.percentile (100) == 100000000);
+        h.record (UINT64_MAX);
+        assert (h.max () == UINT64_MAX);
+        assert (h.percentile (100) == UINT64_MAX);
+    }
+
+    {
+        Metrics metrics;
+        Counter& requests = metrics.counter ("requests.SENDMAIL");
+        requests.add ();
+        metrics.counter ("requests.SENDMAIL").add (2);
+        assert (&requests == &metrics.counter ("requests.SENDMAIL"));
+        assert (requests.value () == 3);
+        metrics.gauge ("queued").set (-1);
+        metrics.histogram ("render_us").record (10);
+
+        std::string json = metrics.to_json ();
+        if (verbose)
+            log_debug ("metrics json: %s", json.c_str ());
+        assert (json == "{\"counters\": {\"requests.SENDMAIL\": 3}, \"gauges\": {\"queued\": -1}, "
+                "\"histograms\": {\"render_us\": {\"count\": 1, \"sum\": 10, \"min\": 10, \"max\": 10, "
+                "\"p50\": 10, \"p90\": 10, \"p99\": 10, \"p999\": 10}}}");
+
+        metrics.counter ("requests.STATS").add ();
+        std::string prom = metrics.to_prometheus ();
+        assert (prom.find ("fty_email_requests_total{key=\"SENDMAIL\"} 3\n") != std::string::npos);
+        assert (prom.find ("fty_email_queued -1\n") != std::string::npos);
+        assert (prom.find ("fty_email_render_us{quantile=\"0.99\"} 10\n") != std::string::npos);
+        assert (prom.find ("fty_email_render_us_count 1\n") != std::string::npos);
+        // one TYPE line for each family, before its samples
+        assert (prom.find ("# TYPE fty_email_requests_total counter\n") < prom.find ("fty_email_requests_total{"));
+        assert (prom.find ("# TYPE fty_email_requests_total counter\n") == prom.rfind ("# TYPE fty_email_requests_total counter\n"));
+        assert (prom.find ("# TYPE fty_email_queued gauge\n") != std::string::npos);
+        assert (prom.find ("# TYPE fty_email_render_us summary\n") != std::string::npos);
+
+        std::string path = std::string (SELFTEST_DIR_RW) + "/metrics.prom";
+        assert (metrics.dump (path) == 0);
+        FILE *file = fopen (path.c_str (), "r");
+        assert (file);
+        char buf [4096];
+        size_t n = fread (buf, 1, sizeof (buf), file);
+        fclose (file);
+        assert (std::string (buf, n) == prom);
+        unlink (path.c_str ());
+    }
+
+    assert (&Metrics::global () == &Metrics::global ());
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,175 @@
+/*  =========================================================================
+    metrics - Registry of counters, gauges and histograms of the agent
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+/**
+ * \class Counter
+ *
+ * \brief Monotonic counter, can be updated from any thread
+ */
+class Counter
+{
+    public:
+        Counter (): _value {0} {}
+
+        void add (uint64_t n = 1) { _value.fetch_add (n, std::memory_order_relaxed); }
+        uint64_t value () const { return _value.load (std::memory_order_relaxed); }
+
+    protected:
+        std::atomic <uint64_t> _value;
+};
+
+/**
+ * \class Gauge
+ *
+ * \brief Value which goes up and down, can be updated from any thread
+ */
+class Gauge
+{
+    public:
+        Gauge (): _value {0} {}
+
+        void set (int64_t value) { _value.store (value, std::memory_order_relaxed); }
+        int64_t value () const { return _value.load (std::memory_order_relaxed); }
+
+    protected:
+        std::atomic <int64_t> _value;
+};
+
+/**
+ * \class Histogram
+ *
+ * \brief HDR histogram of non-negative values, can be updated from any thread
+ *
+ * Values below 64 are counted exactly, bigger ones in log-linear buckets with
+ * 32 sub-buckets per power of two, so percentiles are within 3 % of the true
+ * value over the whole uint64_t range. Recording is one atomic add plus
+ * min/max/sum update, no allocation.
+ */
+class Histogram
+{
+    public:
+        Histogram ();
+
+        Histogram (const Histogram&) = delete;
+        Histogram& operator= (const Histogram&) = delete;
+
+        void record (uint64_t value);
+
+        uint64_t count () const { return _count.load (std::memory_order_relaxed); }
+        uint64_t sum () const { return _sum.load (std::memory_order_relaxed); }
+        /** \brief smallest recorded value, 0 if empty */
+        uint64_t min () const;
+        uint64_t max () const { return _max.load (std::memory_order_relaxed); }
+        /** \brief highest value equivalent to the value at percentile (0.0 - 100.0), 0 if empty */
+        uint64_t percentile (double percentile) const;
+
+    protected:
+        static const unsigned SUB_BITS = 5;
+        static const size_t SUB_COUNT = 1 << SUB_BITS;
+        static const size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+        static size_t s_index (uint64_t value);
+        static uint64_t s_lowest (size_t index);
+
+        std::atomic <uint64_t> _count;
+        std::atomic <uint64_t> _sum;
+        std::atomic <uint64_t> _min;
+        std::atomic <uint64_t> _max;
+        std::unique_ptr <std::atomic <uint64_t>[]> _buckets;
+};
+
+/**
+ * \class Metrics
+ *
+ * \brief Named counters, gauges and histograms
+ *
+ * Metrics are created on the first use and live as long as the registry,
+ * so callers on hot paths keep the returned reference, e.g.
+ *
+ *      static Histogram& render_us = Metrics::global ().histogram ("render_us");
+ *
+ * Name may contain one dot, the part after it is a label value, e.g.
+ * requests.SENDMAIL is exported as fty_email_requests{key="SENDMAIL"}.
+ * Times are in microseconds and their names end with _us.
+ */
+class Metrics
+{
+    public:
+        Metrics () = default;
+
+        Metrics (const Metrics&) = delete;
+        Metrics& operator= (const Metrics&) = delete;
+
+        /** \brief registry of the process */
+        static Metrics& global ();
+
+        Counter& counter (const std::string& name);
+        Gauge& gauge (const std::string& name);
+        Histogram& histogram (const std::string& name);
+
+        /**
+         * \brief all metrics as JSON object
+         *
+         * {"counters": {name: value, ...}, "gauges": {name: value, ...},
+         *  "histograms": {name: {"count", "sum", "min", "max", "p50", "p90", "p99", "p999"}, ...}}
+         */
+        std::string to_json () const;
+
+        /**
+         * \brief all metrics in Prometheus text format, histograms are summaries
+         *
+         * Each metric family is preceded by its # TYPE line (counter, gauge or summary).
+         */
+        std::string to_prometheus () const;
+
+        /** \brief write to_prometheus () to file atomically, return -1 on error */
+        int dump (const std::string& path) const;
+
+    protected:
+        mutable std::mutex _mutex;
+        std::map <std::string, std::unique_ptr <Counter>> _counters;
+        std::map <std::string, std::unique_ptr <Gauge>> _gauges;
+        std::map <std::string, std::unique_ptr <Histogram>> _histograms;
+};
+
+/** \brief monotonic time in microseconds, for durations recorded to metrics */
+int64_t
+    metrics_now_us ();
+
+/** \brief quoted JSON string, control characters are dropped */
+std::string
+    metrics_json_string (const std::string& str);
+
+void
+metrics_test (bool verbose);
+
+#endif // METRICS_H_INCLUDED
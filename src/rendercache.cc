@@ -0,0 +1,148 @@
+/*  =========================================================================
+    rendercache - LRU cache of rendered alert subject/body
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    rendercache - LRU cache of rendered alert subject/body
+@discuss
+@end
+*/
+
+#include "fty_email_classes.h"
+
+std::string
+RenderCache::key (
+        fty_proto_t *alert,
+        const std::string& priority,
+        const std::string& extname,
+        const std::string& language)
+{
+    // fields can't contain \x1f (unit separator), so the key is unambiguous
+    static const char SEP = '\x1f';
+    std::string ret;
+    ret.reserve (256);
+    ret.append (fty_proto_rule (alert)).push_back (SEP);
+    ret.append (extname).push_back (SEP);
+    ret.append (fty_proto_state (alert)).push_back (SEP);
+    ret.append (fty_proto_severity (alert)).push_back (SEP);
+    ret.append (priority).push_back (SEP);
+    ret.append (language).push_back (SEP);
+    ret.append (fty_proto_description (alert));
+    return ret;
+}
+
+const std::string&
+DescriptionCache::get (const char *description)
+{
+    // descriptions are translated to the default language, which may change
+    std::string k = translation_language (std::string ());
+    k.push_back ('\x1f');
+    k.append (description);
+
+    const std::string *cached = lookup (k);
+    if (cached)
+        return *cached;
+
+    return insert (k, translate_description (description));
+}
+
+const RenderedAlert&
+RenderCache::get (
+        fty_proto_t *alert,
+        const std::string& priority,
+        const std::string& extname,
+        const std::string& stated)
+{
+    // contacts of languages which weren't loaded share the default one
+    std::string language = translation_language (stated);
+    std::string k = key (alert, priority, extname, language);
+    const RenderedAlert *cached = lookup (k);
+    if (cached)
+        return *cached;
+
+    const std::string& description = _descriptions.get (fty_proto_description (alert));
+    RenderedAlert rendered;
+    rendered.subject = generate_subject (alert, priority, extname, description, language);
+    rendered.body = generate_body (alert, priority, extname, description, language);
+    return insert (k, std::move (rendered));
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+rendercache_test (bool verbose)
+{
+    printf (" * rendercache: ");
+
+    //  @selftest
+    RenderCache cache {2};
+    assert (cache.size () == 0);
+    assert (!cache.lookup ("a"));
+    assert (cache.misses () == 1);
+
+    cache.insert ("a", RenderedAlert {"subject a", "body a"});
+    cache.insert ("b", RenderedAlert {"subject b", "body b"});
+    assert (cache.size () == 2);
+
+    const RenderedAlert *a = cache.lookup ("a");
+    assert (a);
+    assert (a->subject == "subject a");
+    assert (a->body == "body a");
+    assert (cache.hits () == 1);
+
+    // b is least recently used now
+    cache.insert ("c", RenderedAlert {"subject c", "body c"});
+    assert (cache.size () == 2);
+    assert (!cache.lookup ("b"));
+    assert (cache.lookup ("a"));
+    assert (cache.lookup ("c"));
+    assert (cache.hits () == 3);
+    assert (cache.misses () == 2);
+
+    // replace existing
+    cache.insert ("c", RenderedAlert {"subject C", "body C"});
+    assert (cache.size () == 2);
+    assert (cache.lookup ("c")->subject == "subject C");
+
+    cache.capacity (1);
+    assert (cache.size () == 1);
+    assert (cache.lookup ("c"));
+
+    cache.clear ();
+    assert (cache.size () == 0);
+    assert (!cache.lookup ("c"));
+    assert (cache.hits () == 5);
+    assert (cache.misses () == 3);
+
+    // capacity 0 disables the cache, inserted value is still returned
+    cache.capacity (0);
+    const RenderedAlert& d = cache.insert ("d", RenderedAlert {"subject d", "body d"});
+    assert (d.subject == "subject d");
+    assert (cache.size () == 0);
+    assert (!cache.lookup ("d"));
+
+    // language not loaded by change_translation_language falls back to the default
+    assert (translation_language ("xx_XX") == translation_language (std::string ()));
+    //  @end
+
+    printf ("OK\n");
+}
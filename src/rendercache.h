@@ -0,0 +1,225 @@
+/*  =========================================================================
+    rendercache - LRU cache of rendered alert subject/body
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef RENDERCACHE_H_INCLUDED
+#define RENDERCACHE_H_INCLUDED
+
+#include <list>
+#include <string>
+#include <utility>
+#include <cstdint>
+#include <unordered_map>
+
+/**
+ * \class LruCache
+ *
+ * \brief Bounded map which evicts least recently used items
+ */
+template <typename Value>
+class LruCache
+{
+    public:
+        explicit LruCache (size_t capacity):
+            _capacity {capacity},
+            _hits {0},
+            _misses {0},
+            _items {},
+            _index {},
+            _uncached {}
+        {}
+
+        /** \brief return cached value or NULL, moves found item to front */
+        const Value* lookup (const std::string& key)
+        {
+            auto it = _index.find (key);
+            if (it == _index.end ()) {
+                _misses ++;
+                return NULL;
+            }
+            _hits ++;
+            _items.splice (_items.begin (), _items, it->second);
+            return &it->second->second;
+        }
+
+        /**
+         * \brief insert (or replace) value, evicts least recently used item
+         *
+         * Capacity 0 disables the cache, value is only kept until the next insert.
+         */
+        const Value& insert (const std::string& key, Value value)
+        {
+            if (_capacity == 0) {
+                _uncached = std::move (value);
+                return _uncached;
+            }
+            auto it = _index.find (key);
+            if (it != _index.end ()) {
+                it->second->second = std::move (value);
+                _items.splice (_items.begin (), _items, it->second);
+                return it->second->second;
+            }
+
+            _items.emplace_front (key, std::move (value));
+            _index [key] = _items.begin ();
+            evict ();
+            return _items.front ().second;
+        }
+
+        /** \brief drop all cached items, counters are kept */
+        void clear ()
+        {
+            _index.clear ();
+            _items.clear ();
+        }
+
+        /** \brief change capacity, evicts items over the new capacity */
+        void capacity (size_t capacity)
+        {
+            _capacity = capacity;
+            evict ();
+        }
+        size_t capacity () const { return _capacity; }
+
+        size_t size () const { return _items.size (); }
+        uint64_t hits () const { return _hits; }
+        uint64_t misses () const { return _misses; }
+
+    protected:
+        typedef std::pair <std::string, Value> Item;
+
+        void evict ()
+        {
+            while (_items.size () > _capacity) {
+                _index.erase (_items.back ().first);
+                _items.pop_back ();
+            }
+        }
+
+        size_t _capacity;
+        uint64_t _hits;
+        uint64_t _misses;
+        std::list <Item> _items;
+        std::unordered_map <std::string, typename std::list <Item>::iterator> _index;
+        // value returned by insert when the cache is disabled
+        Value _uncached;
+};
+
+/**
+ * \class DescriptionCache
+ *
+ * \brief Cache of translated alert descriptions
+ *
+ * Alert description is a JSON {"key": ..., "variables": ...}, which must be
+ * parsed and translated. The same descriptions come again and again, so
+ * translated text is remembered under (default language, description).
+ * fty-common-translation can't translate to other than the default language
+ * without switching it for the whole process, so descriptions are always
+ * in the default language.
+ */
+class DescriptionCache : public LruCache <std::string>
+{
+    public:
+        static const size_t DEFAULT_CAPACITY = 1024;
+
+        explicit DescriptionCache (size_t capacity = DEFAULT_CAPACITY):
+            LruCache <std::string> (capacity)
+        {}
+
+        /**
+         * \brief return translated description, translate it on cache miss
+         *
+         * Returned reference is valid until the next call of get/insert/clear.
+         */
+        const std::string& get (const char *description);
+};
+
+/**
+ * \brief subject and body of an alert notification
+ */
+struct RenderedAlert {
+    std::string subject;
+    std::string body;
+};
+
+/**
+ * \class RenderCache
+ *
+ * \brief LRU cache of rendered alert notifications
+ *
+ * During long-running incidents the same alert is notified over and over.
+ * Rendering goes through translation (JSON processing), so the result is
+ * remembered under the tuple
+ * (rule, asset, state, severity, priority, language, description).
+ * On a miss the alert description is translated only once for both subject
+ * and body, using the DescriptionCache.
+ *
+ * Language is a part of the key, so recipients of different languages get
+ * the alert rendered once per language. The key holds the language the alert
+ * is rendered in, not the stated one, so contacts of languages which weren't
+ * loaded share the default language entry, and the cache needs no clearing
+ * when the default language or the loaded languages change.
+ */
+class RenderCache : public LruCache <RenderedAlert>
+{
+    public:
+        static const size_t DEFAULT_CAPACITY = 256;
+
+        explicit RenderCache (size_t capacity = DEFAULT_CAPACITY):
+            LruCache <RenderedAlert> (capacity),
+            _descriptions {}
+        {}
+
+        /**
+         * \brief return rendered alert, render it on cache miss
+         *
+         * Language is the one stated by the contact.
+         * Returned reference is valid until the next call of get/insert/clear.
+         */
+        const RenderedAlert& get (
+                fty_proto_t *alert,
+                const std::string& priority,
+                const std::string& extname,
+                const std::string& language);
+
+        /** \brief drop all rendered alerts and translated descriptions */
+        void clear ()
+        {
+            LruCache <RenderedAlert>::clear ();
+            _descriptions.clear ();
+        }
+
+        const DescriptionCache& descriptions () const { return _descriptions; }
+
+        /** \brief compute the cache key for given alert */
+        static std::string key (
+                fty_proto_t *alert,
+                const std::string& priority,
+                const std::string& extname,
+                const std::string& language);
+
+    protected:
+        DescriptionCache _descriptions;
+};
+
+void
+rendercache_test (bool verbose);
+
+#endif // RENDERCACHE_H_INCLUDED
@@ -0,0 +1,221 @@
+/*  =========================================================================
+    trace - Per-request stage timestamps and their export
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+/*
+@header
+    trace - Per-request stage timestamps and their export
+@discuss
+@end
+*/
+
+#include "fty_email_classes.h"
+
+#include <sstream>
+
+Trace::Trace (const std::string& uuid, const std::string& subject):
+    uuid {uuid},
+    subject {subject},
+    worker {0},
+    _marks {}
+{
+}
+
+int64_t
+Trace::duration (Stage stage) const
+{
+    if (!_marks [stage])
+        return 0;
+    for (int i = stage - 1; i >= 0; i--) {
+        if (_marks [i])
+            return _marks [stage] - _marks [i];
+    }
+    return 0;
+}
+
+int64_t
+Trace::total () const
+{
+    if (!_marks [RECEIVE])
+        return 0;
+    for (int i = STAGES - 1; i > RECEIVE; i--) {
+        if (_marks [i])
+            return _marks [i] - _marks [RECEIVE];
+    }
+    return 0;
+}
+
+const char*
+Trace::stage_name (Stage stage)
+{
+    static const char *names [STAGES] = {
+        "receive",
+        "queue",
+        "decode",
+        "render",
+        "mime",
+        "connect",
+        "data",
+        "reply"
+    };
+    return stage < STAGES ? names [stage] : "unknown";
+}
+
+Tracer::Tracer (size_t capacity):
+    _mutex {},
+    _capacity {capacity},
+    _threshold {DEFAULT_THRESHOLD_US},
+    _traces {}
+{
+}
+
+Tracer&
+Tracer::global ()
+{
+    static Tracer tracer;
+    return tracer;
+}
+
+bool
+Tracer::finish (Trace *trace)
+{
+    std::unique_ptr <Trace> owned (trace);
+    int64_t threshold = this->threshold ();
+    bool slow = threshold > 0 && trace->total () > threshold;
+    if (slow) {
+        std::string stages;
+        for (int i = Trace::QUEUE; i != Trace::STAGES; i++) {
+            Trace::Stage stage = static_cast <Trace::Stage> (i);
+            if (!trace->at (stage))
+                continue;
+            stages += " ";
+            stages += Trace::stage_name (stage);
+            stages += "=" + std::to_string (trace->duration (stage) / 1000) + "ms";
+        }
+        log_warning ("slow request %s (uuid %s) took %" PRId64 " ms:%s",
+                trace->subject.c_str (), trace->uuid.c_str (), trace->total () / 1000, stages.c_str ());
+    }
+
+    std::lock_guard <std::mutex> lock (_mutex);
+    _traces.push_back (std::move (owned));
+    while (_traces.size () > _capacity)
+        _traces.pop_front ();
+    return slow;
+}
+
+size_t
+Tracer::size () const
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    return _traces.size ();
+}
+
+std::string
+Tracer::to_chrome_json () const
+{
+    std::lock_guard <std::mutex> lock (_mutex);
+    std::ostringstream out;
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    const char *sep = "";
+    for (const auto& trace : _traces) {
+        // every stage is a complete event on the row of the worker
+        for (int i = Trace::QUEUE; i != Trace::STAGES; i++) {
+            Trace::Stage stage = static_cast <Trace::Stage> (i);
+            if (!trace->at (stage))
+                continue;
+            int64_t duration = trace->duration (stage);
+            out << sep
+                << "{\"name\": \"" << Trace::stage_name (stage) << "\""
+                << ", \"cat\": " << metrics_json_string (trace->subject)
+                << ", \"ph\": \"X\""
+                << ", \"ts\": " << trace->at (stage) - duration
+                << ", \"dur\": " << duration
+                << ", \"pid\": 1"
+                << ", \"tid\": " << trace->worker
+                << ", \"args\": {\"uuid\": " << metrics_json_string (trace->uuid) << "}}";
+            sep = ", ";
+        }
+    }
+    out << "]}";
+    return out.str ();
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+trace_test (bool verbose)
+{
+    printf (" * trace: ");
+
+    //  @selftest
+    {
+        Trace trace {"UUID", "SENDMAIL"};
+        assert (trace.total () == 0);
+        trace.mark (Trace::RECEIVE, 1000);
+        trace.mark (Trace::QUEUE, 1500);
+        trace.mark (Trace::DECODE, 1600);
+        // no RENDER for SENDMAIL
+        trace.mark (Trace::MIME, 2000);
+        assert (trace.duration (Trace::QUEUE) == 500);
+        assert (trace.duration (Trace::RENDER) == 0);
+        assert (trace.duration (Trace::MIME) == 400);
+        assert (trace.total () == 1000);
+        assert (streq (Trace::stage_name (Trace::CONNECT), "connect"));
+
+        trace.mark (Trace::CONNECT);
+        assert (trace.at (Trace::CONNECT) > 0);
+    }
+
+    {
+        Tracer tracer {2};
+        tracer.threshold (1000);
+
+        Trace *fast = new Trace {"FAST", "SENDMAIL"};
+        fast->mark (Trace::RECEIVE, 1000);
+        fast->mark (Trace::REPLY, 1500);
+        assert (!tracer.finish (fast));
+
+        Trace *slow = new Trace {"SLOW\"", "SENDMAIL_ALERT"};
+        slow->worker = 3;
+        slow->mark (Trace::RECEIVE, 1000);
+        slow->mark (Trace::QUEUE, 1200);
+        slow->mark (Trace::REPLY, 5000);
+        assert (tracer.finish (slow));
+        assert (tracer.size () == 2);
+
+        std::string json = tracer.to_chrome_json ();
+        if (verbose)
+            log_debug ("traces: %s", json.c_str ());
+        assert (json.find ("{\"name\": \"queue\", \"cat\": \"SENDMAIL_ALERT\", \"ph\": \"X\", \"ts\": 1000, \"dur\": 200, "
+                "\"pid\": 1, \"tid\": 3, \"args\": {\"uuid\": \"SLOW\\\"\"}}") != std::string::npos);
+        assert (json.find ("\"name\": \"reply\", \"cat\": \"SENDMAIL_ALERT\", \"ph\": \"X\", \"ts\": 1200, \"dur\": 3800") != std::string::npos);
+
+        // oldest trace is dropped
+        Trace *third = new Trace {"THIRD", "SENDMAIL"};
+        tracer.finish (third);
+        assert (tracer.size () == 2);
+        assert (tracer.to_chrome_json ().find ("FAST") == std::string::npos);
+    }
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,154 @@
+/*  =========================================================================
+    trace - Per-request stage timestamps and their export
+
+    Copyright (C) 2014 - 2017 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+// USDT (SDT) probes of provider fty_email, used by tools/*.bt
+// probe is a single nop when nothing is attached, arguments are only placed
+// in registers; build without sys/sdt.h (or with FTY_EMAIL_NO_PROBES) has none
+#if !defined (FTY_EMAIL_NO_PROBES) && defined (__has_include)
+#   if __has_include (<sys/sdt.h>)
+#       include <sys/sdt.h>
+#       define FTY_EMAIL_HAVE_PROBES 1
+#   endif
+#endif
+
+#ifdef FTY_EMAIL_HAVE_PROBES
+#   define FTY_EMAIL_PROBE2(name, a1, a2) DTRACE_PROBE2 (fty_email, name, a1, a2)
+#   define FTY_EMAIL_PROBE3(name, a1, a2, a3) DTRACE_PROBE3 (fty_email, name, a1, a2, a3)
+#else
+#   define FTY_EMAIL_PROBE2(name, a1, a2) do {} while (0)
+#   define FTY_EMAIL_PROBE3(name, a1, a2, a3) do {} while (0)
+#endif
+
+/**
+ * \class Trace
+ *
+ * \brief Timestamps of the stages of one request
+ *
+ * Dispatcher creates the trace when the request is received and hands it
+ * over to the worker with the request, worker (and its Smtp) marks the end
+ * of each stage the request passes through. Stages which were not reached
+ * (e.g. DECODE of a request which failed before) stay 0.
+ */
+class Trace
+{
+    public:
+        enum Stage {
+            // received from the broker
+            RECEIVE,
+            // taken from the queue by the worker
+            QUEUE,
+            // request decoded
+            DECODE,
+            // alert subject and body rendered
+            RENDER,
+            // MIME message rendered
+            MIME,
+            // msmtp started, it connects to the server
+            CONNECT,
+            // msmtp finished, the server accepted DATA
+            DATA,
+            // reply sent
+            REPLY,
+            STAGES
+        };
+
+        Trace (const std::string& uuid = "", const std::string& subject = "");
+
+        /** \brief stage ended now */
+        void mark (Stage stage) { _marks [stage] = metrics_now_us (); }
+        /** \brief stage ended at given time (metrics_now_us) */
+        void mark (Stage stage, int64_t at) { _marks [stage] = at; }
+
+        /** \brief time when the stage ended, 0 if it was not reached */
+        int64_t at (Stage stage) const { return _marks [stage]; }
+        /** \brief time since the previous reached stage, 0 if stage was not reached */
+        int64_t duration (Stage stage) const;
+        /** \brief time from RECEIVE to the last reached stage */
+        int64_t total () const;
+
+        static const char* stage_name (Stage stage);
+
+        std::string uuid;
+        std::string subject;
+        size_t worker;
+
+    protected:
+        int64_t _marks [STAGES];
+};
+
+/**
+ * \class Tracer
+ *
+ * \brief Collects finished traces
+ *
+ * Requests slower than the threshold are logged with the time of each
+ * stage, the last traces are kept for the export in Chrome trace-event
+ * format (chrome://tracing, Perfetto).
+ */
+class Tracer
+{
+    public:
+        static const size_t DEFAULT_CAPACITY = 1024;
+        static const int64_t DEFAULT_THRESHOLD_US = 10 * 1000 * 1000;
+
+        explicit Tracer (size_t capacity = DEFAULT_CAPACITY);
+
+        Tracer (const Tracer&) = delete;
+        Tracer& operator= (const Tracer&) = delete;
+
+        /** \brief tracer of the process */
+        static Tracer& global ();
+
+        /** \brief requests slower than threshold (microseconds) are logged, 0 turns logging off */
+        void threshold (int64_t threshold) { _threshold.store (threshold, std::memory_order_relaxed); }
+        int64_t threshold () const { return _threshold.load (std::memory_order_relaxed); }
+
+        /** \brief take over finished trace, return true if it was slow */
+        bool finish (Trace *trace);
+
+        /** \brief number of kept traces */
+        size_t size () const;
+
+        /** \brief kept traces as Chrome trace-event JSON, one complete event per stage */
+        std::string to_chrome_json () const;
+
+    protected:
+        mutable std::mutex _mutex;
+        size_t _capacity;
+        std::atomic <int64_t> _threshold;
+        std::deque <std::unique_ptr <Trace>> _traces;
+};
+
+void
+trace_test (bool verbose);
+
+#endif // TRACE_H_INCLUDED